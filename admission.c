@@ -0,0 +1,116 @@
+/* admission.c: Connection Admission Control */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Shared Counters */
+
+typedef struct {
+    size_t  active;                     /*< Number of connections being served */
+    size_t  cgi;                        /*< Number of in-flight CGI processes */
+    size_t  rejected;                   /*< Number of requests shed with 503 */
+} Admission;
+
+static Admission *Counters = NULL;
+
+/**
+ * Allocate admission counters shared by all worker processes.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked.
+ **/
+int admission_init(void) {
+    void *map = mmap(NULL, sizeof(Admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to mmap admission counters: %s\n", strerror(errno));
+        return -1;
+    }
+
+    Counters = map;
+    return 0;
+}
+
+/**
+ * Reserve a slot for a CGI process.
+ *
+ * @return  Whether or not the CGI process may be started.
+ *
+ * Each successful call must be paired with admission_cgi_release.
+ **/
+bool admission_cgi_acquire(void) {
+    if (!Counters) {
+        return true;
+    }
+
+    /* Always count, so the in-flight number is reported even without a limit */
+    if (__atomic_add_fetch(&Counters->cgi, 1, __ATOMIC_ACQ_REL) > MaxCGIProcesses && MaxCGIProcesses) {
+        __atomic_sub_fetch(&Counters->cgi, 1, __ATOMIC_ACQ_REL);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Release slot reserved by admission_cgi_acquire.
+ **/
+void admission_cgi_release(void) {
+    if (!Counters) {
+        return;
+    }
+
+    __atomic_sub_fetch(&Counters->cgi, 1, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Record number of connections currently being served.
+ *
+ * @param   active      Number of active connections.
+ *
+ * This is maintained by whichever process accepts connections.
+ **/
+void admission_active(size_t active) {
+    if (Counters) {
+        __atomic_store_n(&Counters->active, active, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Shed request with a fast 503 Service Unavailable.
+ *
+ * @param   fd          Client socket file descriptor.
+ *
+ * The request itself is not parsed and the response is sent without
+ * blocking (see response_reject), so shedding never stalls the accepting
+ * process.
+ **/
+void admission_reject(int fd) {
+    response_reject(fd, HTTP_STATUS_SERVICE_UNAVAILABLE, RetryAfter);
+
+    if (Counters) {
+        __atomic_add_fetch(&Counters->rejected, 1, __ATOMIC_RELAXED);
+    }
+    log("Rejected request: %s", http_status_string(HTTP_STATUS_SERVICE_UNAVAILABLE));
+}
+
+/**
+ * Write admission report (aggregated over all workers).
+ *
+ * @param   w           Response writer.
+ * @return  -1 on error and 0 on success.
+ **/
+int admission_report(Response *w) {
+    if (!Counters) {
+        return 0;
+    }
+
+    response_printf(w, "connections_active %zu\n", __atomic_load_n(&Counters->active, __ATOMIC_RELAXED));
+    response_printf(w, "cgi_in_flight %zu\n", __atomic_load_n(&Counters->cgi, __ATOMIC_RELAXED));
+    return response_printf(w, "requests_rejected %zu\n", __atomic_load_n(&Counters->rejected, __ATOMIC_RELAXED));
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
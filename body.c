@@ -0,0 +1,277 @@
+/* body.c: Request Bodies */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* A request body is moved to a pipe (a CGI script's stdin) a piece at a
+ * time, never held in memory as a whole.  Bytes the request already buffered
+ * while parsing the headers are copied out of it first; after that the body
+ * is spliced straight from the socket into the pipe.
+ *
+ * Chunked bodies are decoded on the way: size lines and trailers are read
+ * through the request's buffer (only once a whole line has arrived), and
+ * chunk data is spliced like a Content-Length body.
+ * Both ends are non-blocking, so a slow client or a script that is not
+ * reading stalls the transfer (and not the caller), which waits on the fd
+ * reported in wait_fd. */
+
+/**
+ * Prepare to read request body.
+ *
+ * @param   b           Body reader.
+ * @param   r           Request structure.
+ * @return  HTTP_STATUS_OK, HTTP_STATUS_BAD_REQUEST for a malformed length or
+ * encoding, or HTTP_STATUS_PAYLOAD_TOO_LARGE if the declared length exceeds
+ * the route's maximum body size.
+ *
+ * Requests without a body (including HTTP/2 streams, whose DATA frames are
+ * not kept) are done immediately.  An HTTP/1.1 client that asked to be told
+ * before sending its body gets 100 Continue.  The body phase deadline
+ * (BodyTimeout) is a budget for the whole body, not for each stall.
+ **/
+HTTPStatus body_init(Body *b, Request *r) {
+    const char *length   = request_header(r, HEADER_CONTENT_LENGTH);
+    const char *encoding = request_header(r, HEADER_TRANSFER_ENCODING);
+    const char *expect   = request_header(r, HEADER_EXPECT);
+    char *end;
+
+    memset(b, 0, sizeof(Body));
+    b->r      = r;
+    b->limit  = r->options ? r->options->max_body : 0;
+    b->length = -1;
+    b->done   = true;
+
+    if (r->version == 20 || (!length && !encoding)) {
+        b->length = 0;
+        return HTTP_STATUS_OK;
+    }
+
+    /* A body with both framings is ambiguous (and a smuggling vector) */
+    if (length && encoding) {
+        debug("Request has both Content-Length and Transfer-Encoding");
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+
+    if (encoding) {
+        if (strcasecmp(encoding, "chunked") != 0) {
+            debug("Unsupported Transfer-Encoding: %s", encoding);
+            return HTTP_STATUS_BAD_REQUEST;
+        }
+        b->chunked = true;
+    } else {
+        errno = 0;
+        unsigned long long n = strtoull(length, &end, 10);
+        if (errno || end == length || *end != '\0' || length[0] == '-') {
+            debug("Invalid Content-Length: %s", length);
+            return HTTP_STATUS_BAD_REQUEST;
+        }
+        if (b->limit && n > b->limit) {
+            debug("Content-Length %llu exceeds limit %zu", n, b->limit);
+            return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+        }
+        b->length    = n;
+        b->remaining = n;
+        if (n == 0) {
+            return HTTP_STATUS_OK;
+        }
+    }
+
+    /* HTTP/1.0 clients do not understand interim responses */
+    if (expect && r->version == 11 && strcasecmp(expect, "100-continue") == 0) {
+        static const char Continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (send(r->fd, Continue, sizeof(Continue) - 1, MSG_NOSIGNAL) < 0) {
+            debug("Unable to send 100 Continue: %s", strerror(errno));
+        }
+    }
+
+    b->done = false;
+    request_set_phase(r, PHASE_BODY);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Record that the caller must wait for fd to become ready for events (unless
+ * the body deadline has passed).
+ **/
+static ssize_t body_wait(Body *b, int fd, short events) {
+    if (b->r->expired) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    b->wait_fd     = fd;
+    b->wait_events = events;
+    errno = EAGAIN;
+    return -1;
+}
+
+/**
+ * Read line from request once it has fully arrived (EOF is ECONNRESET).
+ *
+ * An incomplete line stays buffered and the caller is told to wait for the
+ * socket (EAGAIN), so framing lines never block the transfer either.
+ **/
+static char * body_line(Body *b) {
+    size_t length;
+    char  *line = request_line(b->r, &length, false);
+
+    if (!line) {
+        if (errno == 0) {
+            errno = ECONNRESET;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            body_wait(b, b->r->fd, POLLIN);
+        }
+    }
+    return line;
+}
+
+/**
+ * Read next chunk size line (and the trailers after the last chunk).
+ *
+ * @return  -1 on error (EPROTO for malformed framing, E2BIG over the limit,
+ * EAGAIN until the next line has arrived) and 0 on success.
+ *
+ * Each line is accounted for as soon as it is read, so a call that returned
+ * EAGAIN resumes where it left off.
+ **/
+static int body_chunk(Body *b) {
+    char *line;
+    char *end;
+
+    /* Chunk data is followed by a line ending */
+    if (b->crlf) {
+        if (!(line = body_line(b))) {
+            return -1;
+        }
+        if (line[0] != '\r' && line[0] != '\n') {
+            errno = EPROTO;
+            return -1;
+        }
+        b->crlf = false;
+    }
+
+    if (!b->trailers) {
+        if (!(line = body_line(b))) {
+            return -1;
+        }
+        errno = 0;
+        unsigned long long size = strtoull(line, &end, 16);
+        if (errno || end == line || (*end != ';' && *end != '\r' && *end != '\n')) {
+            debug("Invalid chunk size: %.*s", (int)strcspn(line, "\r\n"), line);
+            errno = EPROTO;
+            return -1;
+        }
+        if (b->limit && size > b->limit - b->total) {
+            debug("Chunked body exceeds limit %zu", b->limit);
+            errno = E2BIG;
+            return -1;
+        }
+        if (size > 0) {
+            b->remaining = size;
+            return 0;
+        }
+        b->trailers = true;
+    }
+
+    /* Discard trailers up to the blank line */
+    do {
+        if (!(line = body_line(b))) {
+            return -1;
+        }
+    } while (line[0] != '\r' && line[0] != '\n');
+    b->done = true;
+    return 0;
+}
+
+/**
+ * Account for n body bytes taken from the client.
+ **/
+static void body_advance(Body *b, size_t n) {
+    b->remaining -= n;
+    b->total     += n;
+    if (b->remaining == 0) {
+        if (b->chunked) {
+            b->crlf = true;
+        } else {
+            b->done = true;
+        }
+    }
+}
+
+/**
+ * Move some of the request body to a pipe.
+ *
+ * @param   b           Body reader.
+ * @param   fd          Write end of pipe (non-blocking).
+ * @return  Number of bytes moved, 0 once the whole body has been written, or
+ * -1 on error.  EAGAIN means no progress is possible until wait_fd is ready
+ * for wait_events; E2BIG means the body exceeds the limit; EPROTO means the
+ * chunked framing is malformed; EPIPE means the reader closed the pipe.
+ **/
+ssize_t body_transfer(Body *b, int fd) {
+    Request *r = b->r;
+    ssize_t  n;
+
+    /* Bytes copied out of the request stream go first */
+    if (b->start < b->end) {
+        n = write(fd, b->buffer + b->start, b->end - b->start);
+        if (n < 0) {
+            return errno == EAGAIN ? body_wait(b, fd, POLLOUT) : -1;
+        }
+        b->start += n;
+        return n;
+    }
+
+    if (b->remaining == 0 && !b->done && body_chunk(b) < 0) {
+        return -1;
+    }
+    if (b->done) {
+        return 0;
+    }
+
+    /* Copy what the request already buffered (without reading the socket
+     * again) */
+    size_t buffered = request_buffered(r);
+    if (buffered > 0) {
+        size_t want = buffered < b->remaining ? buffered : b->remaining;
+        if (want > sizeof(b->buffer)) {
+            want = sizeof(b->buffer);
+        }
+        b->start = 0;
+        b->end   = request_read(r, b->buffer, want);
+        body_advance(b, b->end);
+        return b->end;
+    }
+
+    /* Otherwise splice from the socket straight into the pipe */
+    n = splice(r->fd, NULL, fd, NULL, b->remaining, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (n < 0) {
+        if (errno != EAGAIN) {
+            return -1;
+        }
+
+        /* Either side may be the one holding us up */
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        if (poll(&pfd, 1, 0) == 0) {
+            return body_wait(b, fd, POLLOUT);
+        }
+        return body_wait(b, r->fd, POLLIN);
+    }
+    body_advance(b, n);
+    return n;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
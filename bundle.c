@@ -0,0 +1,540 @@
+/* bundle.c: Memory-Mapped Site Bundle */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Bundle Format
+ *
+ *  BundleHeader
+ *  uint32_t     displacements[nbuckets]
+ *  BundleRecord records[nslots]
+ *  blob         (NUL-terminated strings and file contents)
+ *
+ * Keys are URIs relative to RootPath ("/", "/html", "/html/index.html").
+ * Lookup uses hash-and-displace perfect hashing: the bucket for a key is
+ * hash(key, 0) % nbuckets and its slot is hash(key, displacement) % nslots.
+ * Every offset is relative to the start of the file; offset 0 marks an empty
+ * slot or absent variant.
+ */
+
+#define BUNDLE_MAGIC        "SPDYBNDL"
+#define BUNDLE_VERSION      1
+#define BUNDLE_MAX_SEED     (1 << 20)
+
+typedef struct {
+    char        magic[8];               /*< BUNDLE_MAGIC */
+    uint32_t    version;                /*< BUNDLE_VERSION */
+    uint32_t    count;                  /*< Number of entries */
+    uint32_t    nbuckets;               /*< Number of displacement buckets */
+    uint32_t    nslots;                 /*< Number of record slots */
+} BundleHeader;
+
+typedef struct {
+    uint64_t    uri;                    /*< Offset of URI string */
+    uint64_t    mimetype;               /*< Offset of mimetype string */
+    uint64_t    etag;                   /*< Offset of ETag string */
+    uint64_t    data;                   /*< Offset of contents */
+    uint64_t    length;                 /*< Length of contents */
+    uint64_t    gzip;                   /*< Offset of gzip variant (or 0) */
+    uint64_t    gzip_length;            /*< Length of gzip variant */
+} BundleRecord;
+
+/* Mapped Bundle */
+
+static const char         *BundleMap      = NULL;
+static size_t              BundleSize     = 0;
+static const BundleHeader *BundleHead     = NULL;
+static const uint32_t     *BundleDisplace = NULL;
+static const BundleRecord *BundleRecords  = NULL;
+
+/**
+ * Compute seeded FNV-1a hash of string.
+ *
+ * @param   s           String to hash.
+ * @param   length      Length of string.
+ * @param   seed        Hash seed (displacement).
+ * @return  64-bit hash value.
+ **/
+static uint64_t bundle_hash(const char *s, size_t length, uint32_t seed) {
+    uint64_t h = 14695981039346656037ULL ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ULL);
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Compute length of URI key, ignoring any trailing slash (except for root).
+ *
+ * @param   uri         Request URI.
+ * @return  Length of canonical key.
+ **/
+static size_t bundle_key_length(const char *uri) {
+    size_t length = strlen(uri);
+    while (length > 1 && uri[length - 1] == '/') {
+        length--;
+    }
+    return length;
+}
+
+/**
+ * Check that a blob range lies within the bundle (after its tables).
+ **/
+static bool bundle_valid_range(size_t size, size_t tables, uint64_t offset, uint64_t length) {
+    return offset >= tables && offset <= size && length <= size - offset;
+}
+
+/**
+ * Check that a blob string lies within the bundle and is NUL-terminated.
+ **/
+static bool bundle_valid_string(const char *map, size_t size, size_t tables, uint64_t offset) {
+    return offset >= tables && offset < size && memchr(map + offset, '\0', size - offset) != NULL;
+}
+
+/**
+ * Check that every offset of a used record lies within the bundle.
+ **/
+static bool bundle_valid_record(const char *map, size_t size, size_t tables, const BundleRecord *record) {
+    if (record->uri == 0) {
+        return true;
+    }
+
+    return bundle_valid_string(map, size, tables, record->uri) &&
+           bundle_valid_string(map, size, tables, record->mimetype) &&
+           bundle_valid_string(map, size, tables, record->etag) &&
+           bundle_valid_range(size, tables, record->data, record->length) &&
+           (record->gzip == 0 || bundle_valid_range(size, tables, record->gzip, record->gzip_length));
+}
+
+/**
+ * Map bundle file into memory and validate its header and records.
+ *
+ * @param   path        Path to bundle file.
+ * @return  -1 on error and 0 on success.
+ *
+ * The mapping is shared (read-only) by all worker processes, so every worker
+ * starts warm from the page cache.  Every record is checked once here, so a
+ * truncated or corrupt bundle is refused up front and lookups can trust the
+ * offsets they hand out.
+ **/
+int bundle_open(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open bundle %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(BundleHeader)) {
+        fprintf(stderr, "Invalid bundle %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to mmap bundle %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (madvise(map, st.st_size, MADV_WILLNEED) < 0) {
+        debug("Unable to madvise bundle: %s", strerror(errno));
+    }
+
+    const BundleHeader *header = map;
+    size_t tables = sizeof(BundleHeader) + header->nbuckets * sizeof(uint32_t) + header->nslots * sizeof(BundleRecord);
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BUNDLE_VERSION || header->nbuckets == 0 ||
+        header->nslots == 0 || tables > (size_t)st.st_size) {
+        fprintf(stderr, "Invalid bundle %s\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    const BundleRecord *records = (const BundleRecord *)((const char *)map + sizeof(BundleHeader) + header->nbuckets * sizeof(uint32_t));
+    for (uint32_t i = 0; i < header->nslots; i++) {
+        if (!bundle_valid_record(map, st.st_size, tables, &records[i])) {
+            fprintf(stderr, "Invalid bundle %s: record %u is out of bounds\n", path, i);
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+
+    /* Replace previously loaded bundle (configuration reload) */
+    if (BundleMap) {
+        munmap((void *)BundleMap, BundleSize);
+    }
+
+    BundleMap      = map;
+    BundleSize     = st.st_size;
+    BundleHead     = header;
+    BundleDisplace = (const uint32_t *)(BundleMap + sizeof(BundleHeader));
+    BundleRecords  = records;
+
+    log("Loaded bundle %s with %u entries", path, header->count);
+    return 0;
+}
+
+/**
+ * Lookup URI in mapped bundle.
+ *
+ * @param   uri         Request URI (without query).
+ * @param   entry       BundleEntry to fill in.
+ * @return  Whether or not the URI was found in the bundle.
+ **/
+bool bundle_lookup(const char *uri, BundleEntry *entry) {
+    if (!BundleMap || !uri) {
+        return false;
+    }
+
+    size_t   length = bundle_key_length(uri);
+    uint32_t bucket = bundle_hash(uri, length, 0) % BundleHead->nbuckets;
+    uint32_t slot   = bundle_hash(uri, length, BundleDisplace[bucket]) % BundleHead->nslots;
+    const BundleRecord *record = &BundleRecords[slot];
+
+    if (record->uri == 0) {
+        return false;
+    }
+
+    const char *key = BundleMap + record->uri;
+    if (strncmp(key, uri, length) != 0 || key[length] != '\0') {
+        return false;
+    }
+
+    entry->data        = BundleMap + record->data;
+    entry->length      = record->length;
+    entry->mimetype    = BundleMap + record->mimetype;
+    entry->etag        = BundleMap + record->etag;
+    entry->gzip        = record->gzip ? BundleMap + record->gzip : NULL;
+    entry->gzip_length = record->gzip_length;
+    return true;
+}
+
+/* Bundle Builder */
+
+typedef struct {
+    char       *uri;                    /*< URI key */
+    char       *mimetype;               /*< Mimetype string */
+    char        etag[24];               /*< Quoted ETag string */
+    char       *data;                   /*< Contents */
+    size_t      length;                 /*< Length of contents */
+    char       *gzip;                   /*< Precompressed contents (or NULL) */
+    size_t      gzip_length;            /*< Length of precompressed contents */
+    uint32_t    bucket;                 /*< Displacement bucket */
+    uint32_t    slot;                   /*< Assigned record slot */
+} BuildEntry;
+
+static BuildEntry *BuildEntries  = NULL;
+static size_t      BuildCount    = 0;
+static size_t      BuildCapacity = 0;
+static size_t      BuildRootLength = 0;
+
+/**
+ * Read entire file into newly allocated buffer.
+ **/
+static char * bundle_read_file(const char *path, size_t *length) {
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        return NULL;
+    }
+
+    size_t capacity = BUFSIZ, nread;
+    char  *data     = malloc(capacity);
+    *length = 0;
+    while (data && (nread = fread(data + *length, 1, capacity - *length, fs)) > 0) {
+        *length += nread;
+        if (*length == capacity) {
+            char *grown = realloc(data, capacity * 2);
+            if (!grown) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            data      = grown;
+            capacity *= 2;
+        }
+    }
+
+    fclose(fs);
+    return data;
+}
+
+/**
+ * Render directory listing as handle_browse_request would.
+ **/
+static char * bundle_render_directory(const char *path, size_t *length) {
+    struct dirent **entries = NULL;
+    char  *data  = NULL;
+    FILE  *fs;
+    int    n;
+
+    if ((n = scandir(path, &entries, NULL, alphasort)) < 0) {
+        return NULL;
+    }
+
+    if ((fs = open_memstream(&data, length)) != NULL) {
+        fprintf(fs, "<html><body><ul>\r\n");
+        for (int i = 0; i < n; i++) {
+            fprintf(fs, "<li>%s</li>\r\n", entries[i]->d_name);
+        }
+        fprintf(fs, "</ul></body></html>\r\n");
+        fclose(fs);
+    }
+
+    for (int i = 0; i < n; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    return data;
+}
+
+/**
+ * Add file or directory to list of bundle entries (nftw callback).
+ **/
+static int bundle_add_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    BuildEntry entry = {0};
+    (void)ftw;
+    const char *uri  = path + BuildRootLength;
+    size_t      plen = strlen(path);
+
+    if (type == FTW_F) {
+        /* CGI scripts must still execute from the filesystem */
+        if (st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) {
+            return 0;
+        }
+
+        /* Precompressed variants are attached to their original below */
+        if (plen > 3 && streq(path + plen - 3, ".gz")) {
+            char original[PATH_MAX];
+            snprintf(original, sizeof(original), "%.*s", (int)(plen - 3), path);
+            if (access(original, F_OK) == 0) {
+                return 0;
+            }
+        }
+
+        entry.data     = bundle_read_file(path, &entry.length);
+        entry.mimetype = determine_mimetype(path);
+
+        char variant[PATH_MAX];
+        snprintf(variant, sizeof(variant), "%s.gz", path);
+        entry.gzip = bundle_read_file(variant, &entry.gzip_length);
+    } else if (type == FTW_D) {
+        entry.data     = bundle_render_directory(path, &entry.length);
+        entry.mimetype = strdup("text/html");
+    } else {
+        return 0;
+    }
+
+    if (!entry.data || !entry.mimetype) {
+        fprintf(stderr, "Unable to bundle %s: %s\n", path, strerror(errno));
+        free(entry.data);
+        free(entry.mimetype);
+        free(entry.gzip);
+        return -1;
+    }
+
+    entry.uri = strdup(*uri ? uri : "/");
+    snprintf(entry.etag, sizeof(entry.etag), "\"%016llx\"",
+        (unsigned long long)bundle_hash(entry.data, entry.length, 0));
+
+    if (BuildCount == BuildCapacity) {
+        BuildCapacity = BuildCapacity ? BuildCapacity * 2 : 64;
+        BuildEntries  = realloc(BuildEntries, BuildCapacity * sizeof(BuildEntry));
+        if (!BuildEntries) {
+            return -1;
+        }
+    }
+    BuildEntries[BuildCount++] = entry;
+    debug("Bundled %s (%zu bytes%s)", entry.uri, entry.length, entry.gzip ? ", gzip" : "");
+    return 0;
+}
+
+/**
+ * Compare buckets by number of keys (descending) for displacement search.
+ **/
+static int bundle_compare_buckets(const void *a, const void *b, void *sizes) {
+    uint32_t sa = ((uint32_t *)sizes)[*(const uint32_t *)a];
+    uint32_t sb = ((uint32_t *)sizes)[*(const uint32_t *)b];
+    return (sa < sb) - (sa > sb);
+}
+
+/**
+ * Compute displacement for each bucket so every key maps to a unique slot.
+ **/
+static int bundle_place_entries(uint32_t *displace, uint32_t nbuckets, uint32_t nslots) {
+    uint32_t *sizes    = calloc(nbuckets, sizeof(uint32_t));
+    uint32_t *order    = calloc(nbuckets, sizeof(uint32_t));
+    bool     *occupied = calloc(nslots, sizeof(bool));
+    int       status   = -1;
+
+    if (!sizes || !order || !occupied) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < BuildCount; i++) {
+        BuildEntries[i].bucket = bundle_hash(BuildEntries[i].uri, strlen(BuildEntries[i].uri), 0) % nbuckets;
+        sizes[BuildEntries[i].bucket]++;
+    }
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        order[b] = b;
+    }
+    qsort_r(order, nbuckets, sizeof(uint32_t), bundle_compare_buckets, sizes);
+
+    for (uint32_t o = 0; o < nbuckets && sizes[order[o]] > 0; o++) {
+        uint32_t bucket = order[o];
+        uint32_t seed;
+
+        for (seed = 1; seed < BUNDLE_MAX_SEED; seed++) {
+            size_t placed = 0;
+            for (size_t i = 0; i < BuildCount; i++) {
+                BuildEntry *e = &BuildEntries[i];
+                if (e->bucket != bucket) {
+                    continue;
+                }
+                e->slot = bundle_hash(e->uri, strlen(e->uri), seed) % nslots;
+                if (occupied[e->slot]) {
+                    break;
+                }
+                occupied[e->slot] = true;
+                placed++;
+            }
+
+            if (placed == sizes[bucket]) {
+                break;
+            }
+
+            /* Undo partial placement and try next seed */
+            for (size_t i = 0; i < BuildCount && placed > 0; i++) {
+                if (BuildEntries[i].bucket == bucket) {
+                    occupied[BuildEntries[i].slot] = false;
+                    placed--;
+                }
+            }
+        }
+
+        if (seed == BUNDLE_MAX_SEED) {
+            fprintf(stderr, "Unable to find perfect hash displacement\n");
+            goto done;
+        }
+        displace[bucket] = seed;
+    }
+    status = 0;
+
+done:
+    free(sizes);
+    free(order);
+    free(occupied);
+    return status;
+}
+
+/**
+ * Build bundle file from directory tree.
+ *
+ * @param   root        Root directory to pack (typically RootPath).
+ * @param   path        Path of bundle file to write.
+ * @return  -1 on error and 0 on success.
+ *
+ * Regular non-executable files and directory listings are packed; CGI
+ * scripts are left to be served from the filesystem.  A sibling "FILE.gz"
+ * is stored as the precompressed variant of "FILE".
+ **/
+int bundle_build(const char *root, const char *path) {
+    int status = -1;
+    FILE *fs = NULL;
+    uint32_t *displace = NULL;
+    BundleRecord *records = NULL;
+
+    BuildRootLength = strlen(root);
+    while (BuildRootLength > 1 && root[BuildRootLength - 1] == '/') {
+        BuildRootLength--;
+    }
+    if (nftw(root, bundle_add_entry, 16, FTW_PHYS) != 0) {
+        goto done;
+    }
+
+    BundleHeader header = {
+        .magic    = BUNDLE_MAGIC,
+        .version  = BUNDLE_VERSION,
+        .count    = BuildCount,
+        .nbuckets = BuildCount / 4 + 1,
+        .nslots   = BuildCount + BuildCount / 4 + 1,
+    };
+
+    displace = calloc(header.nbuckets, sizeof(uint32_t));
+    records  = calloc(header.nslots, sizeof(BundleRecord));
+    if (!displace || !records || bundle_place_entries(displace, header.nbuckets, header.nslots) < 0) {
+        goto done;
+    }
+
+    /* Lay out blob after the tables */
+    uint64_t offset = sizeof(header) + header.nbuckets * sizeof(uint32_t) + header.nslots * sizeof(BundleRecord);
+    for (size_t i = 0; i < BuildCount; i++) {
+        BuildEntry   *e = &BuildEntries[i];
+        BundleRecord *r = &records[e->slot];
+        r->uri         = offset; offset += strlen(e->uri) + 1;
+        r->mimetype    = offset; offset += strlen(e->mimetype) + 1;
+        r->etag        = offset; offset += strlen(e->etag) + 1;
+        r->data        = offset; offset += e->length;
+        r->length      = e->length;
+        r->gzip        = e->gzip ? offset : 0; offset += e->gzip_length;
+        r->gzip_length = e->gzip_length;
+    }
+
+    if ((fs = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        goto done;
+    }
+
+    fwrite(&header, sizeof(header), 1, fs);
+    fwrite(displace, sizeof(uint32_t), header.nbuckets, fs);
+    fwrite(records, sizeof(BundleRecord), header.nslots, fs);
+    for (size_t i = 0; i < BuildCount; i++) {
+        BuildEntry *e = &BuildEntries[i];
+        fwrite(e->uri, 1, strlen(e->uri) + 1, fs);
+        fwrite(e->mimetype, 1, strlen(e->mimetype) + 1, fs);
+        fwrite(e->etag, 1, strlen(e->etag) + 1, fs);
+        fwrite(e->data, 1, e->length, fs);
+        if (e->gzip) {
+            fwrite(e->gzip, 1, e->gzip_length, fs);
+        }
+    }
+
+    if (fclose(fs) != 0) {
+        fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+        goto done;
+    }
+
+    log("Wrote bundle %s with %zu entries", path, BuildCount);
+    status = 0;
+
+done:
+    for (size_t i = 0; i < BuildCount; i++) {
+        free(BuildEntries[i].uri);
+        free(BuildEntries[i].mimetype);
+        free(BuildEntries[i].data);
+        free(BuildEntries[i].gzip);
+    }
+    free(BuildEntries);
+    free(displace);
+    free(records);
+    BuildEntries = NULL;
+    BuildCount   = BuildCapacity = 0;
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
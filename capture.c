@@ -0,0 +1,134 @@
+/* capture.c: Request Capture */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/* Each parsed request is appended to the capture file as one JSON object per
+ * line (the same JSON lines format replay.py reads):
+ *
+ *  {"ts": 1700000000.123456, "method": "GET", "uri": "/", "query": null,
+ *   "headers": {"Host": "localhost:9898", ...}}
+ *
+ * Lines are written with a single write to a file opened O_APPEND, so lines
+ * from concurrent workers never interleave. */
+
+static int CaptureFd = -1;
+
+/**
+ * Open capture file.
+ *
+ * @param   path        Path to capture file (appended to).
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked.
+ **/
+int capture_open(const char *path) {
+    CaptureFd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (CaptureFd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write string as a JSON string literal (or null).
+ *
+ * Request bytes need not be valid UTF-8, so control characters and every
+ * byte from 0x7f up are written as \u00XX: each byte maps to the code
+ * point of the same value, which keeps the line valid JSON and lets the
+ * raw bytes be recovered (e.g. by encoding the decoded string as Latin-1).
+ **/
+static void capture_string(FILE *stream, const char *s) {
+    if (!s) {
+        fputs("null", stream);
+        return;
+    }
+
+    fputc('"', stream);
+    for (const unsigned char *c = (const unsigned char *)s; *c; c++) {
+        switch (*c) {
+            case '"':   fputs("\\\"", stream); break;
+            case '\\':  fputs("\\\\", stream); break;
+            case '\t':  fputs("\\t", stream);  break;
+            default:
+                if (*c < 0x20 || *c >= 0x7f) {
+                    fprintf(stream, "\\u%04x", *c);
+                } else {
+                    fputc(*c, stream);
+                }
+                break;
+        }
+    }
+    fputc('"', stream);
+}
+
+/**
+ * Append parsed request to capture file.
+ *
+ * @param   r           Request structure.
+ *
+ * The timestamp is the wall clock time the request arrived (its first bytes,
+ * or the stream for HTTP/2), not when it finished parsing.  Failures are
+ * logged and otherwise ignored.
+ **/
+void capture_record(Request *r) {
+    struct timespec now;
+    char   *line   = NULL;
+    size_t  length = 0;
+
+    if (CaptureFd < 0) {
+        return;
+    }
+
+    FILE *stream = open_memstream(&line, &length);
+    if (!stream) {
+        debug("Unable to open_memstream: %s", strerror(errno));
+        return;
+    }
+
+    uint64_t arrival = r->marks[MARK_FIRST_BYTE] ? r->marks[MARK_FIRST_BYTE] : r->marks[MARK_ACCEPT];
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(stream, "{\"ts\": %.6f, \"method\": ", now.tv_sec + now.tv_nsec / 1e9 - (trace_now() - arrival) / 1e9);
+    capture_string(stream, r->method);
+    fputs(", \"uri\": ", stream);
+    capture_string(stream, r->uri);
+    fputs(", \"query\": ", stream);
+    capture_string(stream, r->query);
+    fputs(", \"headers\": {", stream);
+
+    bool first = true;
+    for (HeaderId id = 0; id < HEADER_KNOWN; id++) {
+        if (r->known[id]) {
+            fputs(first ? "" : ", ", stream);
+            capture_string(stream, header_name(id));
+            fputs(": ", stream);
+            capture_string(stream, r->known[id]);
+            first = false;
+        }
+    }
+    for (Header *header = r->headers; header; header = header->next) {
+        fputs(first ? "" : ", ", stream);
+        capture_string(stream, header->name);
+        fputs(": ", stream);
+        capture_string(stream, header->value);
+        first = false;
+    }
+    fputs("}}\n", stream);
+    fclose(stream);
+
+    if (write(CaptureFd, line, length) != (ssize_t)length) {
+        debug("Unable to write capture: %s", strerror(errno));
+    }
+    free(line);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,48 +3,185 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <string.h>
 
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/**
+ * Reap all exited children.
+ *
+ * @param   upgrade     Pid of the upgraded server (or 0), which is not a
+ *                      connection handler.
+ * @return  Number of connection handlers reaped.
+ **/
+static size_t reap_children(pid_t upgrade) {
+    size_t reaped = 0;
+    pid_t  pid;
+
+    /* SIGCHLD may coalesce, so always waitpid until nothing is left */
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (pid != upgrade) {
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listeners   Listening sockets.
+ * @param   nlisteners  Number of listening sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
  * The parent should accept a request and then fork off and let the child
  * handle the request.
+ *
+ * Children are reaped through a SIGCHLD signalfd polled alongside the server
+ * socket.  Once MaxConnections children are running, new connections are
+ * shed with 503 Service Unavailable instead of being forked.  Children are
+ * never killed by the parent: each one bounds itself with its phase
+ * deadlines (idle, header, body), the write stall timeout, the CGI wall
+ * clock limit and the upstream timeouts, so a connection may live as long
+ * as it keeps making progress.
+ *
+ * SIGHUP reloads the configuration.  SIGUSR2 hands the listening sockets to
+ * an upgraded binary; once it is accepting, this server closes them, waits
+ * for its in-flight children to finish, and exits.
  **/
-int forking_server(int sfd) {
+int forking_server(Listener *listeners, size_t nlisteners) {
+    size_t active = 0;
+    bool   draining = false;
+    pid_t  upgrade = 0;
+    sigset_t mask, oldmask;
+
+    /* Route signals to a signalfd so children are reaped (and restarts
+     * handled) synchronously */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &mask, &oldmask) < 0) {
+        fprintf(stderr, "Unable to sigprocmask: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0) {
+        fprintf(stderr, "Unable to signalfd: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Signal descriptor is polled after the listeners */
+    struct pollfd pfds[LISTENERS_MAX + 1];
+    for (size_t i = 0; i < nlisteners; i++) {
+        pfds[i].fd     = listeners[i].fd;
+        pfds[i].events = POLLIN;
+    }
+    pfds[nlisteners].fd     = sigfd;
+    pfds[nlisteners].events = POLLIN;
+
     /* Accept and handle HTTP request */
     while (true) {
-        /* Accept request */
-        Request *r = accept_request(sfd);
-        /* Ignore children */
-        
-        /* Fork off child process to handle request */
-        pid_t pid = fork();
-        if(pid<0) {
-            debug("Failed to fork: %s\n", strerror(pid));
+        int ready = poll(pfds, nlisteners + 1, -1);
+        if (ready <= 0) {
+            if (ready < 0 && errno != EINTR) {
+                fprintf(stderr, "Unable to poll: %s\n", strerror(errno));
+            }
+            continue;
         }
-        else if(pid == 0) {
-            close(sfd);
-            HTTPStatus status = handle_request(r);
-	    free_request(r);
-            debug("Request Status: %s", http_status_string(status));
-            _exit(EXIT_SUCCESS);
+
+        /* Handle signals and reap children */
+        if (pfds[nlisteners].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGHUP) {
+                    restart_reload();
+                } else if (info.ssi_signo == SIGUSR2 && !draining && (upgrade = restart_upgrade(listeners, nlisteners)) > 0) {
+                    draining = true;
+                    for (size_t i = 0; i < nlisteners; i++) {
+                        close(listeners[i].fd);
+                        listeners[i].fd = pfds[i].fd = -1;
+                    }
+                }
+            }
+
+            size_t reaped = reap_children(upgrade);
+            active = reaped > active ? 0 : active - reaped;
+            admission_active(active);
         }
-        else {
-            free_request(r);
+
+        if (draining) {
+            if (active == 0) {
+                log("Drained all requests; exiting");
+                break;
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < nlisteners; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            /* Accept request */
+            Request *r = accept_request(&listeners[i]);
+            if (!r) {
+                continue;
+            }
+
+            /* Turn away clients over their rate limit before forking */
+            uint64_t wait = ratelimit_check(r, NULL);
+            if (wait) {
+                ratelimit_reject(r, wait);
+                free_request(r);
+                continue;
+            }
+
+            /* Shed load once connection limit is reached */
+            if (MaxConnections && active >= MaxConnections) {
+                admission_reject(r->fd);
+                free_request(r);
+                continue;
+            }
+
+            /* Fork off child process to handle request */
+            pid_t pid = fork();
+            if(pid<0) {
+                debug("Failed to fork: %s\n", strerror(errno));
+                admission_reject(r->fd);
+                free_request(r);
+            }
+            else if(pid == 0) {
+                for (size_t j = 0; j < nlisteners; j++) {
+                    close(listeners[j].fd);
+                }
+                close(sigfd);
+                sigprocmask(SIG_SETMASK, &oldmask, NULL);
+                HTTPStatus status = handle_request(r);
+                free_request(r);
+                debug("Request Status: %s", http_status_string(status));
+                _exit(EXIT_SUCCESS);
+            }
+            else {
+                admission_active(++active);
+                free_request(r);
+            }
         }
     }
 
-    /* Close server socket */
-    close(sfd);
+    /* Close server sockets */
+    close(sigfd);
+    for (size_t i = 0; i < nlisteners; i++) {
+        if (listeners[i].fd >= 0) {
+            close(listeners[i].fd);
+        }
+    }
     return EXIT_SUCCESS;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
-
@@ -0,0 +1,925 @@
+/* h2.c: Cleartext HTTP/2 (h2c) Server */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Streams are multiplexed on the wire but not in the handlers: each stream
+ * runs the regular HTTP/1 handlers to completion, one at a time, with its
+ * whole response captured in a memfd before any of it is framed.  A slow
+ * handler (a CGI script or proxied upstream) therefore holds up every other
+ * stream on the connection, and a large response is buffered in full. */
+
+/* Constants (RFC 7540) */
+
+#define H2_PREFACE              "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_REST         "SM\r\n\r\n"
+#define H2_FRAME_HEADER         9
+#define H2_DEFAULT_WINDOW       65535
+#define H2_DEFAULT_FRAME        16384
+#define H2_MAX_FRAME            16777215
+#define H2_MAX_WINDOW           0x7fffffff
+#define H2_MAX_HEADER_BLOCK     (64 * 1024)
+
+enum {
+    H2_DATA          = 0x0,
+    H2_HEADERS       = 0x1,
+    H2_PRIORITY      = 0x2,
+    H2_RST_STREAM    = 0x3,
+    H2_SETTINGS      = 0x4,
+    H2_PUSH_PROMISE  = 0x5,
+    H2_PING          = 0x6,
+    H2_GOAWAY        = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION  = 0x9,
+};
+
+enum {
+    H2_FLAG_END_STREAM  = 0x01,
+    H2_FLAG_ACK         = 0x01,
+    H2_FLAG_END_HEADERS = 0x04,
+    H2_FLAG_PADDED      = 0x08,
+    H2_FLAG_PRIORITY    = 0x20,
+};
+
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE      = 0x1,
+    H2_SETTINGS_ENABLE_PUSH            = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE    = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE         = 0x5,
+};
+
+enum {
+    H2_NO_ERROR          = 0x0,
+    H2_PROTOCOL_ERROR    = 0x1,
+    H2_INTERNAL_ERROR    = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED     = 0x5,
+    H2_FRAME_SIZE_ERROR  = 0x6,
+    H2_REFUSED_STREAM    = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+};
+
+/* Connection State */
+
+typedef struct h2_stream H2Stream;
+struct h2_stream {
+    uint32_t     id;                    /*< Stream identifier */
+    bool         ready;                 /*< Whether request is complete */
+    bool         headers_sent;          /*< Whether response HEADERS were sent */
+    Request     *request;               /*< Stream request */
+    int64_t      window;                /*< Send window */
+    uint8_t     *head;                  /*< Encoded response header block */
+    size_t       head_length;           /*< Length of response header block */
+    char        *capture;               /*< Mapped handler output */
+    size_t       capture_length;        /*< Length of handler output */
+    const char  *body;                  /*< Response body within capture */
+    size_t       body_length;           /*< Length of response body */
+    size_t       body_sent;             /*< Bytes of body sent */
+    H2Stream    *next;                  /*< Next stream on connection */
+};
+
+typedef struct {
+    Request     *r;                     /*< Connection request (socket) */
+    Response     w;                     /*< Connection writer */
+    HPACKTable   decoder;               /*< Request header decoding table */
+    H2Stream    *streams;               /*< Open streams */
+    size_t       nstreams;              /*< Number of open streams */
+    uint32_t     last_stream;           /*< Highest client stream identifier */
+    int64_t      window;                /*< Connection send window */
+    uint32_t     initial_window;        /*< Peer SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t     max_frame;             /*< Peer SETTINGS_MAX_FRAME_SIZE */
+    uint8_t     *block;                 /*< Header block being assembled */
+    size_t       block_length;          /*< Length of header block */
+    uint32_t     block_stream;          /*< Stream of header block (0 if none) */
+    bool         block_end_stream;      /*< END_STREAM seen on HEADERS */
+    bool         goaway;                /*< Whether peer sent GOAWAY */
+} H2Connection;
+
+/* Frame Output */
+
+/**
+ * Queue frame on connection writer.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   type        Frame type.
+ * @param   flags       Frame flags.
+ * @param   stream      Stream identifier.
+ * @param   payload     Frame payload.
+ * @param   length      Length of payload.
+ * @param   copy        Whether payload must be copied (false if it lives
+ *                      until the next flush).
+ **/
+static void h2_frame(H2Connection *c, uint8_t type, uint8_t flags, uint32_t stream, const void *payload, size_t length, bool copy) {
+    uint8_t header[H2_FRAME_HEADER] = {
+        length >> 16, length >> 8, length, type, flags,
+        (stream >> 24) & 0x7f, stream >> 16, stream >> 8, stream,
+    };
+
+    response_copy(&c->w, header, sizeof(header));
+    if (length == 0) {
+        return;
+    }
+    if (copy) {
+        response_copy(&c->w, payload, length);
+    } else {
+        response_append(&c->w, payload, length);
+    }
+}
+
+static void h2_put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t h2_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void h2_rst_stream(H2Connection *c, uint32_t stream, uint32_t error) {
+    uint8_t payload[4];
+    h2_put32(payload, error);
+    h2_frame(c, H2_RST_STREAM, 0, stream, payload, sizeof(payload), true);
+}
+
+static void h2_window_update(H2Connection *c, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    h2_put32(payload, increment & H2_MAX_WINDOW);
+    h2_frame(c, H2_WINDOW_UPDATE, 0, stream, payload, sizeof(payload), true);
+}
+
+static void h2_goaway(H2Connection *c, uint32_t error) {
+    uint8_t payload[8];
+    h2_put32(payload, c->last_stream);
+    h2_put32(payload + 4, error);
+    h2_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload), true);
+    response_flush(&c->w, false);
+    debug("Sent GOAWAY with error %u", error);
+}
+
+/* Streams */
+
+static H2Stream * h2_stream_find(H2Connection *c, uint32_t id) {
+    for (H2Stream *s = c->streams; s; s = s->next) {
+        if (s->id == id) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate request for a new stream, inheriting client information.
+ **/
+static Request * h2_stream_request(H2Connection *c) {
+    Request *sr = request_alloc();
+    if (!sr) {
+        return NULL;
+    }
+
+    sr->version  = 20;
+    sr->peer     = c->r->peer;
+    sr->listener = c->r->listener;
+    request_mark(sr, MARK_ACCEPT);
+    sr->written  = response_write_time();
+    return sr;
+}
+
+static H2Stream * h2_stream_open(H2Connection *c, uint32_t id, Request *request) {
+    H2Stream *s = calloc(1, sizeof(H2Stream));
+    if (!s) {
+        return NULL;
+    }
+
+    s->id      = id;
+    s->request = request;
+    s->window  = c->initial_window;
+    s->next    = c->streams;
+    c->streams = s;
+    c->nstreams++;
+    return s;
+}
+
+static void h2_stream_close(H2Connection *c, H2Stream *s) {
+    for (H2Stream **p = &c->streams; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+
+    if (s->capture) {
+        munmap(s->capture, s->capture_length);
+    }
+    free_request(s->request);
+    free(s->head);
+    free(s);
+    c->nstreams--;
+}
+
+/**
+ * Add request header decoded by HPACK (hpack_decode callback).
+ **/
+static void h2_emit_header(void *ctx, const char *name, const char *value) {
+    Request *sr = ctx;
+
+    if (name[0] == ':') {
+        if (streq(name, ":method")) {
+            free(sr->method);
+            sr->method = strdup(value);
+        } else if (streq(name, ":path")) {
+            const char *query = strchr(value, '?');
+            free(sr->uri);
+            free(sr->query);
+            sr->uri   = query ? strndup(value, query - value) : strdup(value);
+            sr->query = query ? strdup(query + 1) : NULL;
+        } else if (streq(name, ":authority")) {
+            h2_emit_header(ctx, "Host", value);
+        }
+        return;
+    }
+
+    request_add_header(sr, name, strlen(name), value, strlen(value));
+}
+
+/**
+ * Convert captured HTTP/1 handler output into an HTTP/2 response.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Handlers (including CGI scripts) write a status line and header block; the
+ * status and headers are HPACK encoded and the remainder becomes the body.
+ * Connection-specific headers are dropped.
+ **/
+static int h2_stream_response(H2Stream *s) {
+    static const char *Hop[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" };
+    const char *p   = s->capture ? s->capture : "";
+    const char *end = p + s->capture_length;
+    const char *eol;
+    bool  length    = false;
+    int   status    = 500;
+    char  line[BUFSIZ];
+
+    s->head = malloc(2 * s->capture_length + 64);
+    if (!s->head) {
+        return -1;
+    }
+
+    /* Status line */
+    if ((eol = memchr(p, '\n', end - p)) != NULL && strncmp(p, "HTTP/", 5) == 0) {
+        const char *code = memchr(p, ' ', eol - p);
+        status = code ? atoi(code + 1) : 500;
+        p = eol + 1;
+    }
+    s->head_length = hpack_encode_status(s->head, status);
+
+    /* Headers */
+    while (p < end && (eol = memchr(p, '\n', end - p)) != NULL) {
+        const char *start = p;
+        size_t      n     = eol - start;
+
+        p = eol + 1;
+        if (n > 0 && start[n - 1] == '\r') {
+            n--;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (n >= sizeof(line)) {
+            continue;
+        }
+
+        memcpy(line, start, n);
+        line[n] = '\0';
+
+        char *value = strchr(line, ':');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        value = skip_whitespace(value);
+
+        bool hop = false;
+        for (size_t i = 0; i < sizeof(Hop) / sizeof(Hop[0]); i++) {
+            hop = hop || strcasecmp(line, Hop[i]) == 0;
+        }
+        if (hop) {
+            continue;
+        }
+
+        length = length || strcasecmp(line, "Content-Length") == 0;
+        s->head_length += hpack_encode_header(s->head + s->head_length, line, value);
+    }
+
+    s->body        = p;
+    s->body_length = end - p;
+
+    if (!length) {
+        char value[32];
+        snprintf(value, sizeof(value), "%zu", s->body_length);
+        s->head_length += hpack_encode_header(s->head + s->head_length, "content-length", value);
+    }
+
+    /* Responses to HEAD keep their headers but carry no body */
+    if (s->request->method && streq(s->request->method, "HEAD")) {
+        s->body_length = 0;
+    }
+    return 0;
+}
+
+/**
+ * Run stream request through the regular handlers.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The handler writes its HTTP/1 response into a memfd instead of the socket;
+ * the capture is then mapped and framed by h2_write_pending.  Handlers run
+ * to completion one at a time (no frames are read or written meanwhile), but
+ * their responses are interleaved on the connection subject to flow control.
+ **/
+static int h2_stream_dispatch(H2Connection *c, H2Stream *s) {
+    Request *sr = s->request;
+
+    s->ready = true;
+    if (!sr->method || !sr->uri) {
+        h2_rst_stream(c, s->id, H2_PROTOCOL_ERROR);
+        h2_stream_close(c, s);
+        return 0;
+    }
+
+    if ((sr->fd = memfd_create("spidey-h2", MFD_CLOEXEC)) < 0) {
+        debug("Unable to memfd_create: %s", strerror(errno));
+        h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+        h2_stream_close(c, s);
+        return 0;
+    }
+
+    log("HTTP/2 stream %u: %s %s", s->id, sr->method, sr->uri);
+    request_mark(sr, MARK_PARSED);
+    request_set_phase(sr, PHASE_WRITE);
+    stats_record(sr, dispatch_request(sr));
+
+    off_t size = lseek(sr->fd, 0, SEEK_END);
+    if (size > 0) {
+        s->capture = mmap(NULL, size, PROT_READ, MAP_PRIVATE, sr->fd, 0);
+        if (s->capture == MAP_FAILED) {
+            s->capture = NULL;
+        } else {
+            s->capture_length = size;
+        }
+    }
+
+    if (h2_stream_response(s) < 0) {
+        h2_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+        h2_stream_close(c, s);
+    }
+    return 0;
+}
+
+/**
+ * Send response HEADERS and as much DATA as flow control allows.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Streams are served round-robin, one frame each per pass, so a large
+ * response does not hold back small ones.  DATA payloads are queued by
+ * reference to the mapped captures.
+ **/
+static int h2_write_pending(H2Connection *c) {
+    bool progress = true;
+
+    while (progress) {
+        progress = false;
+
+        for (H2Stream *s = c->streams; s; s = s->next) {
+            if (!s->ready || !s->head) {
+                continue;
+            }
+
+            if (!s->headers_sent) {
+                uint8_t flags  = s->body_length == 0 ? H2_FLAG_END_STREAM : 0;
+                size_t  offset = 0;
+                do {
+                    size_t  n    = s->head_length - offset < c->max_frame ? s->head_length - offset : c->max_frame;
+                    uint8_t type = offset == 0 ? H2_HEADERS : H2_CONTINUATION;
+                    uint8_t end  = offset + n == s->head_length ? H2_FLAG_END_HEADERS : 0;
+                    h2_frame(c, type, (type == H2_HEADERS ? flags : 0) | end, s->id, s->head + offset, n, false);
+                    offset += n;
+                } while (offset < s->head_length);
+                s->headers_sent = true;
+                progress = true;
+                continue;
+            }
+
+            size_t  remaining = s->body_length - s->body_sent;
+            int64_t n         = remaining;
+            if (remaining == 0) {
+                continue;
+            }
+            n = n < c->max_frame ? n : c->max_frame;
+            n = n < s->window    ? n : s->window;
+            n = n < c->window    ? n : c->window;
+            if (n <= 0) {
+                continue;
+            }
+
+            h2_frame(c, H2_DATA, (size_t)n == remaining ? H2_FLAG_END_STREAM : 0, s->id, s->body + s->body_sent, n, false);
+            s->body_sent += n;
+            s->window    -= n;
+            c->window    -= n;
+            progress      = true;
+        }
+    }
+
+    if (response_flush(&c->w, false) < 0) {
+        return -1;
+    }
+
+    /* Retire streams whose responses are complete */
+    for (H2Stream *s = c->streams, *next; s; s = next) {
+        next = s->next;
+        if (s->headers_sent && s->body_sent == s->body_length) {
+            h2_stream_close(c, s);
+        }
+    }
+    return 0;
+}
+
+/* Frame Input */
+
+/**
+ * Read exactly length bytes from the connection stream.
+ *
+ * @return  -1 on error or EOF and 0 on success.
+ **/
+static int h2_read(H2Connection *c, void *buffer, size_t length) {
+    return request_read(c->r, buffer, length) == length ? 0 : -1;
+}
+
+/**
+ * Apply SETTINGS payload from peer.
+ *
+ * @return  HTTP/2 error code (H2_NO_ERROR on success).
+ **/
+static uint32_t h2_apply_settings(H2Connection *c, const uint8_t *payload, size_t length) {
+    if (length % 6) {
+        return H2_FRAME_SIZE_ERROR;
+    }
+
+    for (size_t i = 0; i < length; i += 6) {
+        uint16_t id    = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = h2_get32(payload + i + 2);
+
+        switch (id) {
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_MAX_WINDOW) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                for (H2Stream *s = c->streams; s; s = s->next) {
+                    s->window += (int64_t)value - c->initial_window;
+                }
+                c->initial_window = value;
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_DEFAULT_FRAME || value > H2_MAX_FRAME) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                c->max_frame = value;
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            default:
+                /* Responses are not indexed, so the peer's table size is
+                 * irrelevant; unknown settings must be ignored */
+                break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Decode completed header block and open (or finish) its stream.
+ *
+ * @return  HTTP/2 connection error code (H2_NO_ERROR on success).
+ **/
+static uint32_t h2_finish_headers(H2Connection *c) {
+    uint32_t  id = c->block_stream;
+    H2Stream *s  = h2_stream_find(c, id);
+    Request  *sr = s ? NULL : h2_stream_request(c);
+    int       status;
+
+    c->block_stream = 0;
+
+    /* Trailers on an open stream: decode (to keep HPACK state) and drop */
+    if (s) {
+        Request *trailers = h2_stream_request(c);
+        status = trailers ? hpack_decode(&c->decoder, c->block, c->block_length, h2_emit_header, trailers) : -1;
+        free_request(trailers);
+        if (status < 0) {
+            return H2_COMPRESSION_ERROR;
+        }
+        if (c->block_end_stream && !s->ready) {
+            h2_stream_dispatch(c, s);
+        }
+        return H2_NO_ERROR;
+    }
+
+    if (!sr) {
+        return H2_INTERNAL_ERROR;
+    }
+    if (hpack_decode(&c->decoder, c->block, c->block_length, h2_emit_header, sr) < 0) {
+        free_request(sr);
+        return H2_COMPRESSION_ERROR;
+    }
+    if (id % 2 == 0 || id <= c->last_stream) {
+        free_request(sr);
+        return H2_PROTOCOL_ERROR;
+    }
+    c->last_stream = id;
+
+    if (c->nstreams >= MaxStreams) {
+        free_request(sr);
+        h2_rst_stream(c, id, H2_REFUSED_STREAM);
+        return H2_NO_ERROR;
+    }
+
+    if ((s = h2_stream_open(c, id, sr)) == NULL) {
+        free_request(sr);
+        h2_rst_stream(c, id, H2_INTERNAL_ERROR);
+        return H2_NO_ERROR;
+    }
+
+    if (c->block_end_stream) {
+        h2_stream_dispatch(c, s);
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Append header block fragment to pending header block.
+ **/
+static uint32_t h2_append_block(H2Connection *c, const uint8_t *fragment, size_t length) {
+    if (c->block_length + length > H2_MAX_HEADER_BLOCK) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    uint8_t *block = realloc(c->block, c->block_length + length + 1);
+    if (!block) {
+        return H2_INTERNAL_ERROR;
+    }
+    memcpy(block + c->block_length, fragment, length);
+    c->block         = block;
+    c->block_length += length;
+    return H2_NO_ERROR;
+}
+
+/**
+ * Strip padding from DATA or HEADERS payload.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int h2_strip_padding(uint8_t flags, uint8_t **payload, size_t *length) {
+    if (!(flags & H2_FLAG_PADDED)) {
+        return 0;
+    }
+    if (*length < 1 || (*payload)[0] >= *length) {
+        return -1;
+    }
+    *length -= (*payload)[0] + 1;
+    *payload += 1;
+    return 0;
+}
+
+/**
+ * Process one frame from the peer.
+ *
+ * @return  HTTP/2 connection error code (H2_NO_ERROR on success).
+ **/
+static uint32_t h2_process_frame(H2Connection *c, uint8_t type, uint8_t flags, uint32_t id, uint8_t *payload, size_t length) {
+    H2Stream *s;
+
+    /* A header block must be continued without interruption */
+    if (c->block_stream && (type != H2_CONTINUATION || id != c->block_stream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    switch (type) {
+        case H2_HEADERS:
+            if (id == 0 || h2_strip_padding(flags, &payload, &length) < 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (flags & H2_FLAG_PRIORITY) {
+                if (length < 5) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                payload += 5;
+                length  -= 5;
+            }
+            c->block_length     = 0;
+            c->block_stream     = id;
+            c->block_end_stream = flags & H2_FLAG_END_STREAM;
+            if (h2_append_block(c, payload, length) != H2_NO_ERROR) {
+                return H2_PROTOCOL_ERROR;
+            }
+            return (flags & H2_FLAG_END_HEADERS) ? h2_finish_headers(c) : H2_NO_ERROR;
+
+        case H2_CONTINUATION:
+            if (!c->block_stream) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (h2_append_block(c, payload, length) != H2_NO_ERROR) {
+                return H2_PROTOCOL_ERROR;
+            }
+            return (flags & H2_FLAG_END_HEADERS) ? h2_finish_headers(c) : H2_NO_ERROR;
+
+        case H2_DATA: {
+            size_t consumed = length;
+            if (id == 0 || h2_strip_padding(flags, &payload, &length) < 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+
+            /* Request bodies are not consumed by handlers; return the
+             * credit immediately so the peer is never stalled */
+            if (consumed > 0) {
+                h2_window_update(c, 0, consumed);
+            }
+
+            s = h2_stream_find(c, id);
+            if (!s || s->ready) {
+                if (id > c->last_stream) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                h2_rst_stream(c, id, H2_STREAM_CLOSED);
+                return H2_NO_ERROR;
+            }
+            if (flags & H2_FLAG_END_STREAM) {
+                h2_stream_dispatch(c, s);
+            } else if (consumed > 0) {
+                h2_window_update(c, id, consumed);
+            }
+            return H2_NO_ERROR;
+        }
+
+        case H2_SETTINGS: {
+            if (id != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (flags & H2_FLAG_ACK) {
+                return length ? H2_FRAME_SIZE_ERROR : H2_NO_ERROR;
+            }
+            uint32_t error = h2_apply_settings(c, payload, length);
+            if (error == H2_NO_ERROR) {
+                h2_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0, true);
+            }
+            return error;
+        }
+
+        case H2_PING:
+            if (id != 0 || length != 8) {
+                return id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR;
+            }
+            if (!(flags & H2_FLAG_ACK)) {
+                h2_frame(c, H2_PING, H2_FLAG_ACK, 0, payload, length, true);
+            }
+            return H2_NO_ERROR;
+
+        case H2_WINDOW_UPDATE: {
+            if (length != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            uint32_t increment = h2_get32(payload) & H2_MAX_WINDOW;
+            if (id == 0) {
+                if (increment == 0 || c->window + increment > H2_MAX_WINDOW) {
+                    return increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR;
+                }
+                c->window += increment;
+            } else if ((s = h2_stream_find(c, id)) != NULL) {
+                if (increment == 0 || s->window + increment > H2_MAX_WINDOW) {
+                    h2_rst_stream(c, id, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+                    h2_stream_close(c, s);
+                } else {
+                    s->window += increment;
+                }
+            }
+            return H2_NO_ERROR;
+        }
+
+        case H2_RST_STREAM:
+            if (id == 0 || length != 4) {
+                return id ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR;
+            }
+            if ((s = h2_stream_find(c, id)) != NULL) {
+                h2_stream_close(c, s);
+            }
+            return H2_NO_ERROR;
+
+        case H2_GOAWAY:
+            c->goaway = true;
+            return H2_NO_ERROR;
+
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR;
+
+        default:
+            /* PRIORITY and unknown frame types are ignored */
+            return H2_NO_ERROR;
+    }
+}
+
+/* Upgrade */
+
+/**
+ * Decode base64url string (HTTP2-Settings header).
+ *
+ * @return  Number of decoded bytes or -1 on error.
+ **/
+static ssize_t h2_base64url_decode(const char *s, uint8_t *out, size_t size) {
+    uint32_t bits  = 0;
+    int      nbits = 0;
+    size_t   n     = 0;
+
+    for (; *s && *s != '='; s++) {
+        int v;
+        if      (*s >= 'A' && *s <= 'Z') v = *s - 'A';
+        else if (*s >= 'a' && *s <= 'z') v = *s - 'a' + 26;
+        else if (*s >= '0' && *s <= '9') v = *s - '0' + 52;
+        else if (*s == '-' || *s == '+') v = 62;
+        else if (*s == '_' || *s == '/') v = 63;
+        else return -1;
+
+        bits   = (bits << 6) | v;
+        nbits += 6;
+        if (nbits >= 8) {
+            if (n == size) {
+                return -1;
+            }
+            nbits -= 8;
+            out[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+/**
+ * Determine whether request asks to upgrade to h2c.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether the connection should switch to HTTP/2.
+ *
+ * Requests with a body are served over HTTP/1 (the upgrade is optional for
+ * the server).
+ **/
+bool h2_upgrade_requested(Request *r) {
+    const char *upgrade  = request_header(r, HEADER_UPGRADE);
+    const char *settings = request_header(r, HEADER_HTTP2_SETTINGS);
+    const char *length   = request_header(r, HEADER_CONTENT_LENGTH);
+
+    return MaxStreams > 0 && upgrade && settings && strcasestr(upgrade, "h2c") &&
+           !request_header(r, HEADER_TRANSFER_ENCODING) && (!length || atoi(length) == 0);
+}
+
+/**
+ * Serve HTTP/2 connection.
+ *
+ * @param   r           HTTP Request structure (connection).
+ * @param   upgraded    Whether this is an h2c upgrade (as opposed to the
+ *                      prior knowledge preface).
+ * @return  Status of the HTTP/2 connection.
+ *
+ * For an upgrade, r is the HTTP/1.1 request that becomes stream 1.  The
+ * connection is served until the peer closes it, goes away, or idles past
+ * IdleTimeout.  If the switch fails before anything is sent (invalid
+ * HTTP2-Settings or preface), r is answered and recorded as an HTTP/1 error.
+ **/
+HTTPStatus h2_serve(Request *r, bool upgraded) {
+    H2Connection c = {
+        .r              = r,
+        .window         = H2_DEFAULT_WINDOW,
+        .initial_window = H2_DEFAULT_WINDOW,
+        .max_frame      = H2_DEFAULT_FRAME,
+    };
+    uint8_t     header[H2_FRAME_HEADER];
+    uint8_t    *payload = malloc(H2_DEFAULT_FRAME);
+    uint8_t     settings[12];
+    uint32_t    error   = H2_NO_ERROR;
+    HTTPStatus  status  = HTTP_STATUS_OK;
+    char        preface[sizeof(H2_PREFACE)];
+
+    log("Switching to HTTP/2 (%s)", upgraded ? "upgrade" : "prior knowledge");
+    response_init(&c.w, r->fd, NULL);
+    if (!payload || hpack_init(&c.decoder, 4096) < 0) {
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        goto done;
+    }
+
+    if (upgraded) {
+        static const char Switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        uint8_t  decoded[256];
+        ssize_t  n = h2_base64url_decode(request_header(r, HEADER_HTTP2_SETTINGS), decoded, sizeof(decoded));
+
+        /* The 101 response implicitly acknowledges HTTP2-Settings */
+        if (n < 0 || h2_apply_settings(&c, decoded, n) != H2_NO_ERROR) {
+            status = HTTP_STATUS_BAD_REQUEST;
+            goto done;
+        }
+        response_append(&c.w, Switching, sizeof(Switching) - 1);
+    } else if (h2_read(&c, preface, strlen(H2_PREFACE_REST)) < 0 || strncmp(preface, H2_PREFACE_REST, strlen(H2_PREFACE_REST)) != 0) {
+        status = HTTP_STATUS_BAD_REQUEST;
+        goto done;
+    }
+
+    /* Server connection preface: SETTINGS */
+    settings[0] = 0; settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS; h2_put32(settings + 2, MaxStreams);
+    settings[6] = 0; settings[7] = H2_SETTINGS_ENABLE_PUSH;            h2_put32(settings + 8, 0);
+    h2_frame(&c, H2_SETTINGS, 0, 0, settings, sizeof(settings), true);
+    response_flush(&c.w, false);
+
+    if (upgraded) {
+        /* Client preface follows the 101 response */
+        request_set_phase(r, PHASE_HEADER);
+        if (h2_read(&c, preface, strlen(H2_PREFACE)) < 0 || strncmp(preface, H2_PREFACE, strlen(H2_PREFACE)) != 0) {
+            error = H2_PROTOCOL_ERROR;
+            goto done;
+        }
+
+        /* The upgraded request becomes half-closed stream 1 */
+        Request  *sr = h2_stream_request(&c);
+        H2Stream *s  = sr ? h2_stream_open(&c, 1, sr) : NULL;
+        if (!s) {
+            free_request(sr);
+            error = H2_INTERNAL_ERROR;
+            goto done;
+        }
+        sr->method  = r->method;  r->method  = NULL;
+        sr->uri     = r->uri;     r->uri     = NULL;
+        sr->query   = r->query;   r->query   = NULL;
+        sr->headers = r->headers; r->headers = NULL;
+        memcpy(sr->known, r->known, sizeof(r->known));
+        memset(r->known, 0, sizeof(r->known));
+        c.last_stream = 1;
+        h2_stream_dispatch(&c, s);
+    }
+
+    while (true) {
+        if (h2_write_pending(&c) < 0) {
+            break;
+        }
+        if (c.goaway && c.nstreams == 0) {
+            break;
+        }
+
+        /* Wait for next frame; the first byte starts the header deadline */
+        request_set_phase(r, PHASE_IDLE);
+        if (h2_read(&c, header, sizeof(header)) < 0) {
+            break;
+        }
+
+        size_t   length = (header[0] << 16) | (header[1] << 8) | header[2];
+        uint8_t  type   = header[3];
+        uint8_t  flags  = header[4];
+        uint32_t id     = h2_get32(header + 5) & H2_MAX_WINDOW;
+
+        if (length > H2_DEFAULT_FRAME) {
+            error = H2_FRAME_SIZE_ERROR;
+            break;
+        }
+        if (h2_read(&c, payload, length) < 0) {
+            break;
+        }
+
+        if ((error = h2_process_frame(&c, type, flags, id, payload, length)) != H2_NO_ERROR) {
+            break;
+        }
+    }
+
+done:
+    if (error != H2_NO_ERROR) {
+        h2_goaway(&c, error);
+        status = HTTP_STATUS_BAD_REQUEST;
+    } else if (status != HTTP_STATUS_OK) {
+        /* Nothing has been sent, so answer the request in HTTP/1 */
+        request_set_phase(r, PHASE_WRITE);
+        handle_error(r, status);
+        stats_record(r, status);
+    }
+
+    while (c.streams) {
+        h2_stream_close(&c, c.streams);
+    }
+    hpack_free(&c.decoder);
+    free(c.block);
+    free(payload);
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,20 +1,34 @@
 /* handler.c: HTTP Request Handlers */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Largest chunk of CGI output relayed at once */
+#define CGI_CHUNK_MAX   (64 * 1024)
+
 /* Internal Declarations */
 HTTPStatus handle_browse_request(Request *request);
+HTTPStatus handle_bundle_request(Request *request, BundleEntry *entry);
 HTTPStatus handle_file_request(Request *request);
 HTTPStatus handle_cgi_request(Request *request);
-HTTPStatus handle_error(Request *request, HTTPStatus status);
+HTTPStatus handle_stats_request(Request *request);
+HTTPStatus handle_proxy_request(Request *request, const ProxyRoute *route);
 
 /**
  * Handle HTTP Request.
@@ -22,8 +36,9 @@ HTTPStatus handle_error(Request *request, HTTPStatus status);
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This parses a request and then either switches the connection to HTTP/2 or
+ * dispatches the request.  Completed HTTP/1 requests are recorded in the
+ * access log and statistics (HTTP/2 streams are recorded individually).
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
@@ -32,45 +47,137 @@ HTTPStatus  handle_request(Request *r) {
     
     /* Parse request */
     if (parse_request(r) == -1){
-        result =HTTP_STATUS_BAD_REQUEST;
+        result = r->expired ? HTTP_STATUS_REQUEST_TIMEOUT : HTTP_STATUS_BAD_REQUEST;
+        request_set_phase(r, PHASE_WRITE);
         handle_error(r, result);
+        stats_record(r, result);
         return result;
     }
-    
-    /* Determine request path */
-    if ((r->path= determine_request_path(r->uri))==NULL){
-        result = HTTP_STATUS_NOT_FOUND;
-        handle_error(r, result);
+    request_set_phase(r, PHASE_WRITE);
+
+    /* Switch to HTTP/2 on prior knowledge preface or h2c upgrade (unless
+     * disabled with a stream limit of 0) */
+    if (MaxStreams > 0 && streq(r->method, "PRI") && streq(r->uri, "*")) {
+        return h2_serve(r, false);
+    }
+    if (h2_upgrade_requested(r)) {
+        return h2_serve(r, true);
+    }
+
+    result = dispatch_request(r);
+    stats_record(r, result);
+    return result;
+}
+
+/**
+ * Dispatch parsed HTTP Request.
+ *
+ * @param   r           HTTP Request structure
+ * @return  Status of the HTTP request.
+ *
+ * This determines the request path, determines the request type, and then
+ * dispatches to the appropriate handler type.  Paths in the compiled route
+ * table are dispatched without touching the filesystem; anything else (such
+ * as content added since the table was compiled) is resolved and classified
+ * with realpath and stat.  The response is written to
+ * r->fd, which for HTTP/2 streams is a capture buffer rather than the socket.
+ **/
+HTTPStatus  dispatch_request(Request *r) {
+    HTTPStatus result =0;
+
+    /* Record request for replay */
+    capture_record(r);
+
+    /* Apply per-prefix rate limits */
+    uint64_t wait = ratelimit_check(r, r->uri);
+    if (wait) {
+        ratelimit_reject(r, wait);
+        return HTTP_STATUS_TOO_MANY_REQUESTS;
+    }
+
+    /* Report statistics */
+    if (StatsPath && streq(r->uri, StatsPath)) {
+        request_mark(r, MARK_RESOLVED);
+        return handle_stats_request(r);
+    }
+
+    /* Forward to upstream servers */
+    const ProxyRoute *route = proxy_lookup(r->uri);
+    if (route) {
+        request_mark(r, MARK_RESOLVED);
+        PROBE(request__resolved, r->fd, r->uri);
+        result = handle_proxy_request(r, route);
+        if (result != HTTP_STATUS_OK) {
+            handle_error(r, result);
+        }
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
         return result;
     }
-    debug("HTTP REQUEST PATH: %s", r->path);
 
-    /* Dispatch to appropriate request handler type based on file type */
-    
-    struct stat storeStat;
-    if ( (stat(r->path, &storeStat)) == -1){
-        result= HTTP_STATUS_INTERNAL_SERVER_ERROR;
-        handle_error(r, result);
+    /* Serve static content directly from site bundle if present */
+    BundleEntry entry;
+    if (bundle_lookup(r->uri, &entry)) {
+        request_mark(r, MARK_RESOLVED);
+        PROBE(request__resolved, r->fd, r->uri);
+        result = handle_bundle_request(r, &entry);
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
         return result;
     }
-    else if ((storeStat.st_mode & S_IFMT)   == S_IFREG){
-        if (access(r->path, X_OK )){
-            result = handle_cgi_request(r);
-        } else if (access(r->path, R_OK)){
-            result= handle_file_request(r);
-        } else {
-            result= handle_error(r, HTTP_STATUS_NOT_FOUND);
-	    return result;
+
+    /* Determine request path and type from the route table */
+    RouteKind kind;
+    off_t     size;
+    if ((r->route = route_lookup(r->uri, &r->options))) {
+        r->path = strdup(r->route->path);
+        kind    = r->route->kind;
+        size    = r->route->size;
+    } else {
+        if ((r->path= determine_request_path(r->uri))==NULL){
+            result = HTTP_STATUS_NOT_FOUND;
+            handle_error(r, result);
+            return result;
+        }
+
+        struct stat storeStat;
+        if ( (stat(r->path, &storeStat)) == -1){
+            result= HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            handle_error(r, result);
+            return result;
         }
+        kind = route_classify(r->path, storeStat.st_mode, r->options);
+        size = storeStat.st_size;
     }
-    else if ((storeStat.st_mode & S_IFMT) == S_IFDIR){
-        result= handle_browse_request(r);
+    debug("HTTP REQUEST PATH: %s", r->path);
+    request_mark(r, MARK_RESOLVED);
+    PROBE(request__resolved, r->fd, r->path);
+
+    /* Start reading large files from disk while the handler gets going */
+    if (kind == ROUTE_FILE && size >= IOPOOL_THRESHOLD && IOThreads > 0) {
+        iopool_advise(r->path);
+    }
+
+    /* Dispatch to appropriate request handler type */
+    switch (kind) {
+        case ROUTE_CGI:
+            result = handle_cgi_request(r);
+            break;
+        case ROUTE_FILE:
+            result = handle_file_request(r);
+            break;
+        case ROUTE_BROWSE:
+            result = handle_browse_request(r);
+            break;
+        default:
+            result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+            log("HTTP REQUEST STATUS: %s", http_status_string(result));
+            return result;
     }
     
-    if( result != HTTP_STATUS_OK) {
+    if( result != HTTP_STATUS_OK && result != HTTP_STATUS_SERVICE_UNAVAILABLE) {
 	handle_error(r, result);
     }
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
+    request_mark(r, MARK_HANDLED);
     
     return result;
     
@@ -98,31 +205,152 @@ HTTPStatus  handle_browse_request(Request *r) {
 	return HTTP_STATUS_NOT_FOUND;
     }
     /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->file, "Content-Type: text/html\r\n\r\n");
+    Response w;
+    response_init(&w, r->fd, r);
+    response_status(&w, HTTP_STATUS_OK);
+    response_header(&w, "Content-Type", "text/html");
+    response_end_headers(&w);
+
     /* For each entry in directory, emit HTML list item */
-    fprintf(r->file, "<html><body><ul>\r\n");
+    response_printf(&w, "<html><body><ul>\r\n");
     for(int i = 0; i<n; i++) {
-	fprintf(r->file, "<li>%s</li>\r\n", entries[i]->d_name);
+	response_printf(&w, "<li>%s</li>\r\n", entries[i]->d_name);
 	free(entries[i]);
     }
-    fprintf(r->file, "</ul></body></html>\r\n");
-   /* fprintf(stdout, "<html><body><ul>\r\n");
-    for(int i = 0; i<n; i++) {
-	fprintf(stdout, "<li>%s</li>\r\n", entries[i]->d_name);
-	free(entries[i]);
-    }
-    fprintf(stdout, "</ul></body></html>\r\n");
-   */
+    response_printf(&w, "</ul></body></html>\r\n");
     free(entries);
 
     /* Flush socket, return OK */
-    if (fflush(r->file) !=0){
+    if (response_flush(&w, false) < 0) {
         debug("Could not flush, %s", strerror(errno));
     }
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Handle bundle request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   entry       Bundle entry matching request URI.
+ * @return  Status of the HTTP bundle request.
+ *
+ * This writes the mapped contents (or precompressed variant, if the client
+ * accepts gzip) straight from the bundle with no filesystem access.  If the
+ * client already has the current ETag, respond with Not Modified.
+ **/
+HTTPStatus  handle_bundle_request(Request *r, BundleEntry *entry) {
+    log("handle_bundle_request");
+    const char *etag     = request_header(r, HEADER_IF_NONE_MATCH);
+    const char *encoding = request_header(r, HEADER_ACCEPT_ENCODING);
+    const char *data     = entry->data;
+    size_t      length   = entry->length;
+    bool        gzip     = entry->gzip && encoding && strstr(encoding, "gzip");
+
+    Response w;
+    response_init(&w, r->fd, r);
+
+    if (etag && streq(etag, entry->etag)) {
+        response_status(&w, HTTP_STATUS_NOT_MODIFIED);
+        response_header(&w, "ETag", entry->etag);
+        response_end_headers(&w);
+        response_flush(&w, false);
+        return HTTP_STATUS_NOT_MODIFIED;
+    }
+
+    if (gzip) {
+        data   = entry->gzip;
+        length = entry->gzip_length;
+    }
+
+    response_status(&w, HTTP_STATUS_OK);
+    response_header(&w, "Content-Type", entry->mimetype);
+    response_content_length(&w, length);
+    response_header(&w, "ETag", entry->etag);
+    if (gzip) {
+        response_header(&w, "Content-Encoding", "gzip");
+    }
+    if (entry->gzip) {
+        response_header(&w, "Vary", "Accept-Encoding");
+    }
+    response_end_headers(&w);
+    response_append(&w, data, length);
+
+    if (response_flush(&w, false) < 0) {
+        debug("Could not flush, %s", strerror(errno));
+    }
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Stream large file to response through the I/O pool.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   w           Response writer (headers queued).
+ * @param   fd          File to stream.
+ * @param   size        Size of file.
+ * @return  -1 on error and 0 on success.
+ *
+ * Two blocks alternate: while one is written to the socket, a pool thread
+ * reads the next into the other, so a cold file costs the slower of disk and
+ * network rather than both.
+ **/
+static int handle_file_pooled(Request *r, Response *w, int fd, off_t size) {
+    char   *blocks[2] = { malloc(IOPOOL_BLOCK), malloc(IOPOOL_BLOCK) };
+    int     notify    = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    IOTask  task      = { .op = IO_READ, .fd = fd, .notify = notify };
+    off_t   offset    = 0;
+    int     current   = 0;
+    int     status    = -1;
+
+    if (!blocks[0] || !blocks[1] || notify < 0) {
+        fprintf(stderr, "Unable to prepare pooled read: %s\n", strerror(errno));
+        goto done;
+    }
+
+    task.buffer = blocks[current];
+    task.length = size < IOPOOL_BLOCK ? size : IOPOOL_BLOCK;
+    iopool_submit(&task);
+
+    while (true) {
+        ssize_t nread = iopool_wait(&task);
+        if (nread < 0) {
+            debug("Could not read %s: %s", r->path, strerror(errno));
+            break;
+        }
+        offset += nread;
+
+        /* Queue the next read before writing this block */
+        bool more = nread > 0 && offset < size;
+        if (more) {
+            task.buffer = blocks[!current];
+            task.offset = offset;
+            task.length = size - offset < IOPOOL_BLOCK ? size - offset : IOPOOL_BLOCK;
+            iopool_submit(&task);
+        }
+
+        if (response_append(w, blocks[current], nread) < 0 || response_flush(w, more) < 0) {
+            debug("Could not write: %s", strerror(errno));
+            if (more) {
+                iopool_wait(&task);
+            }
+            break;
+        }
+        if (!more) {
+            status = 0;
+            break;
+        }
+        current = !current;
+    }
+
+done:
+    if (notify >= 0) {
+        close(notify);
+    }
+    free(blocks[0]);
+    free(blocks[1]);
+    return status;
+}
+
 /**
  * Handle file request.
  *
@@ -130,99 +358,343 @@ HTTPStatus  handle_browse_request(Request *r) {
  * @return  Status of the HTTP file request.
  *
  * This opens and streams the contents of the specified file to the socket.
+ * Files from the route table carry their mimetype and, if the route enables
+ * it and the client accepts gzip, a precompressed variant to send instead.
+ * Routes with a TTL add Cache-Control.  Large files are read by the I/O
+ * pool, a block ahead of the socket.
  *
  * If the path cannot be opened for reading, then handle error with
  * HTTP_STATUS_NOT_FOUND.
  **/
 HTTPStatus  handle_file_request(Request *r) {
     log("handle_file_request");
-    FILE *fs;
     char buffer[BUFSIZ];
     char *mimetype = NULL;
-    size_t nread;
+    struct stat st;
+    ssize_t nread;
+    off_t remaining;
+    int fd;
+
+    const char *encoding = request_header(r, HEADER_ACCEPT_ENCODING);
+    const char *gzip     = r->route ? r->route->gzip : NULL;
+    if (gzip && !(encoding && strstr(encoding, "gzip"))) {
+        gzip = NULL;
+    }
 
-    /* Open file for reading */
-    fs = fopen(r->path, "w+");
-    if (!fs) {
-        fprintf(stderr, "fopen failed: %s\n", strerror(errno));
+    /* Open file (or its precompressed variant) for reading */
+    fd = open(gzip ? gzip : r->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open failed: %s\n", strerror(errno));
+        return HTTP_STATUS_NOT_FOUND;
+    }
+    if (fstat(fd, &st) < 0) {
+        debug("Could not stat %s: %s", r->path, strerror(errno));
+        close(fd);
         return HTTP_STATUS_NOT_FOUND;
     }
 
     /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);
+    if (r->route && r->route->mimetype) {
+        mimetype = strdup(r->route->mimetype);
+    } else {
+        mimetype = determine_mimetype(r->path);
+    }
     debug("Mimetype: %s", mimetype);
 
     /* Write HTTP Headers with OK status and determined Content-Type */
-    Header *temp = r->headers;
-    fprintf(r->file, "HTTP/1.0 200 OK\n");
-    fprintf(r->file, "Content-Type: %s", mimetype);
-    while (temp != NULL) {
-        fprintf(r->file, "%s: %s\n", temp->name, temp->value);
-        temp = temp->next;
-    }
-    fprintf(r->file, "\n");
-
-    /* Read from file and write to socket in chunks */
-    while ((nread = fread(buffer, sizeof(char), BUFSIZ, fs)) > 0) {
-        if(nread <= 0) {
+    Response w;
+    response_init(&w, r->fd, r);
+    response_status(&w, HTTP_STATUS_OK);
+    response_header(&w, "Content-Type", mimetype);
+    response_content_length(&w, st.st_size);
+    if (r->options && r->options->ttl >= 0) {
+        char control[32];
+        snprintf(control, sizeof(control), "max-age=%d", r->options->ttl);
+        response_header(&w, "Cache-Control", control);
+    }
+    if (gzip) {
+        response_header(&w, "Content-Encoding", "gzip");
+    }
+    if (r->route && r->route->gzip) {
+        response_header(&w, "Vary", "Accept-Encoding");
+    }
+    response_end_headers(&w);
+
+    /* Read from file and write to socket in chunks; the first chunk shares a
+     * writev with the headers */
+    remaining = st.st_size;
+    if (remaining >= IOPOOL_THRESHOLD && IOThreads > 0) {
+        if (handle_file_pooled(r, &w, fd, remaining) < 0) {
+            goto fail;
+        }
+        remaining = 0;
+    }
+    while (remaining > 0 && (nread = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             debug("Could not read %s: %s", r->path, strerror(errno));
             goto fail;
         }
-        size_t fwritten = fwrite(buffer, sizeof(char), nread, r->file);
-        if(fwritten <= 0) {
+        remaining -= nread;
+        if (response_append(&w, buffer, nread) < 0 || response_flush(&w, remaining > 0) < 0) {
             debug("Could not write: %s", strerror(errno));
             goto fail;
         }
-        while (fwritten != nread) {
-            fwritten += fwrite(buffer, sizeof(char), nread-fwritten, r->file);
-        }
+    }
+    if (response_flush(&w, false) < 0) {
+        goto fail;
     }
 
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    fclose(fs);
-    fflush(r->file);
+    /* Close file, deallocate mimetype, return OK */
+    close(fd);
     free(mimetype);
     return HTTP_STATUS_OK;
 
 fail:
     /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    fclose(fs);
+    close(fd);
     free(mimetype);
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
 
+/**
+ * Apply configured resource limits and niceness (in CGI child).
+ *
+ * The CPU limit sends SIGXCPU at the limit and SIGKILL a second later; the
+ * memory and file size limits make allocations and writes fail.
+ **/
+static void handle_cgi_limits(void) {
+    struct rlimit limit;
+
+    if (CGICPULimit > 0) {
+        limit.rlim_cur = CGICPULimit;
+        limit.rlim_max = CGICPULimit + 1;
+        setrlimit(RLIMIT_CPU, &limit);
+    }
+    if (CGIMemoryLimit > 0) {
+        limit.rlim_cur = limit.rlim_max = (rlim_t)CGIMemoryLimit << 20;
+        setrlimit(RLIMIT_AS, &limit);
+    }
+    if (CGIFileLimit > 0) {
+        limit.rlim_cur = limit.rlim_max = (rlim_t)CGIFileLimit << 20;
+        setrlimit(RLIMIT_FSIZE, &limit);
+    }
+    if (CGINice != 0 && setpriority(PRIO_PROCESS, 0, CGINice) < 0) {
+        fprintf(stderr, "Unable to setpriority: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Start CGI script with pipes for its stdin and stdout.
+ *
+ * @param   path        Path of script.
+ * @param   in          Set to write end of script's stdin (non-blocking).
+ * @param   out         Set to read end of script's stdout (non-blocking).
+ * @return  Process id of script, or -1 on error.
+ *
+ * The script leads its own process group, so killing the group also ends
+ * anything the script started (which would otherwise keep stdout open).  The
+ * script is also killed if the worker serving it dies, rather than being
+ * left to run past every limit.
+ **/
+static pid_t handle_cgi_spawn(const char *path, int *in, int *out) {
+    int stdin_pipe[2];
+    int stdout_pipe[2];
+
+    if (pipe2(stdin_pipe, O_CLOEXEC) < 0) {
+        fprintf(stderr, "Unable to pipe: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pipe2(stdout_pipe, O_CLOEXEC) < 0) {
+        fprintf(stderr, "Unable to pipe: %s\n", strerror(errno));
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
+        return -1;
+    }
+
+    pid_t parent = getpid();
+    pid_t pid    = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
+        close(stdout_pipe[0]);
+        close(stdout_pipe[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        /* Undo the server's signal setup, which would survive exec */
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        setpgid(0, 0);
+        if (prctl(PR_SET_PDEATHSIG, SIGKILL) < 0 || getppid() != parent) {
+            _exit(EXIT_FAILURE);
+        }
+        handle_cgi_limits();
+
+        if (dup2(stdin_pipe[0], STDIN_FILENO) < 0 || dup2(stdout_pipe[1], STDOUT_FILENO) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        execlp(path, path, (char *)NULL);
+        fprintf(stderr, "Unable to exec %s: %s\n", path, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    setpgid(pid, pid);
+    close(stdin_pipe[0]);
+    close(stdout_pipe[1]);
+    fcntl(stdin_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(stdout_pipe[0], F_SETFL, O_NONBLOCK);
+    *in  = stdin_pipe[1];
+    *out = stdout_pipe[0];
+    return pid;
+}
+
+/**
+ * Translate CGI header block into the response head.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   w           Response writer.
+ * @param   buffer      Start of script output.
+ * @param   length      Number of bytes of output read so far.
+ * @return  Length of the header block, 0 if it is not complete yet, or -1 if
+ * it is invalid.
+ *
+ * The status comes from a Status header, a Location header (302 Found) or,
+ * for scripts that write a whole response head themselves, an HTTP/1.x
+ * status line; otherwise it is 200 OK.  Other headers, such as Content-Type
+ * and Location, are passed on, except those that describe the connection.
+ **/
+static ssize_t handle_cgi_headers(Request *r, Response *w, const char *buffer, size_t length) {
+    static const char *Skip[] = { "Status", "Connection", "Keep-Alive", "Transfer-Encoding", "Server" };
+    const char *end   = NULL;
+    const char *line  = buffer;
+    int         code  = 200;
+    char        reason[64] = "OK";
+    bool        status = false;
+    bool        sized  = false;
+
+    /* Find end of header block and determine status */
+    while (!end) {
+        const char *newline = memchr(line, '\n', buffer + length - line);
+        if (!newline) {
+            return 0;
+        }
+
+        size_t n = newline - line - (newline > line && newline[-1] == '\r');
+        if (n == 0) {
+            end = newline + 1;
+            break;
+        }
+
+        const char *colon = memchr(line, ':', n);
+        if (line == buffer && n > 5 && strncmp(line, "HTTP/", 5) == 0) {
+            if (sscanf(line, "HTTP/%*s %3d %63[^\r\n]", &code, reason) < 1) {
+                return -1;
+            }
+            status = true;
+        } else if (!colon || colon == line) {
+            return -1;
+        } else if (colon - line == 6 && strncasecmp(line, "Status", 6) == 0) {
+            reason[0] = '\0';
+            if (sscanf(colon + 1, " %3d %63[^\r\n]", &code, reason) < 1) {
+                return -1;
+            }
+            status = true;
+        } else if (colon - line == 8 && strncasecmp(line, "Location", 8) == 0 && !status) {
+            code = 302;
+            strcpy(reason, "Found");
+        } else if (colon - line == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+            sized = true;
+        }
+        line = newline + 1;
+    }
+    if (code < 100 || code > 999) {
+        return -1;
+    }
+
+    /* Queue status line and the headers worth passing on */
+    w->chunked = r->version == 11 && !sized;
+    if (response_status_code(w, code, reason) < 0) {
+        return -1;
+    }
+    for (line = buffer; line < end; ) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t      n       = newline - line - (newline > line && newline[-1] == '\r');
+        const char *colon   = memchr(line, ':', n);
+        bool        pass    = colon != NULL;
+
+        for (size_t i = 0; pass && i < sizeof(Skip) / sizeof(Skip[0]); i++) {
+            pass = !((size_t)(colon - line) == strlen(Skip[i]) && strncasecmp(line, Skip[i], colon - line) == 0);
+        }
+        if (pass && response_printf(w, "%.*s\r\n", (int)n, line) < 0) {
+            return -1;
+        }
+        line = newline + 1;
+    }
+    if (response_end_headers(w) < 0) {
+        return -1;
+    }
+    return end - buffer;
+}
+
 /**
  * Handle CGI request
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This runs the specified executable, streams the request body (if any) into
+ * its stdin, and streams its stdout to the socket.  Body and output are moved
+ * concurrently, so a script may answer before it has read all of its input
+ * and neither side can deadlock on a full pipe.  A chunked body is decoded
+ * and has no CONTENT_LENGTH; the script reads it to end of file.
+ *
+ * The script's header block becomes the response head (see
+ * handle_cgi_headers).  Unless the script sets Content-Length, the output
+ * of an HTTP/1.1 request is framed with chunked encoding, so a truncated
+ * response is detectable and the connection is not needed to delimit it.
+ * Connections are still closed after every response (see CommonHeaders in
+ * response.c); the framing is what keep-alive would need, not keep-alive.
+ *
+ * Scripts run under the configured resource limits (-x), and one that runs
+ * past the wall clock limit, or stays silent for WriteTimeout once its body
+ * has been sent, is killed along with its process group.  Its resource
+ * usage is recorded for the access log and statistics.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * If the script cannot be started, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR; if it produces no valid header block,
+ * with HTTP_STATUS_BAD_GATEWAY, or HTTP_STATUS_GATEWAY_TIMEOUT if it was
+ * killed for running too long.  A malformed or oversized body is
+ * answered with HTTP_STATUS_BAD_REQUEST or HTTP_STATUS_PAYLOAD_TOO_LARGE if
+ * the script has not produced output yet.
  **/
 HTTPStatus handle_cgi_request(Request *r) {
     log(" handle_cgi_request");
+    char host[REQUEST_HOST_MAX];
+    char port[16];
 
     /* Export CGI environment variables from request structure:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    Header *head = r->headers;
-    
     if (setenv("DOCUMENT_ROOT", RootPath, 1) == -1) {
         fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
     }
     
-    if (setenv("QUERY_STRING", r->query, 1) == -1) {
+    if (setenv("QUERY_STRING", r->query ? r->query : "", 1) == -1) {
         fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
     }
 
-    if (setenv("REMOTE_ADDR", r->host, 1) == -1) {
+    if (setenv("REMOTE_ADDR", request_host(r, host, sizeof(host)), 1) == -1) {
         fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
     }
 
-    if (setenv("REMOTE_PORT", r->port, 1) == -1) {
+    snprintf(port, sizeof(port), "%u", r->peer.port);
+    if (setenv("REMOTE_PORT", port, 1) == -1) {
         fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
     }
 
@@ -238,69 +710,241 @@ HTTPStatus handle_cgi_request(Request *r) {
         fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
     }
 
-    if (setenv("SERVER_PORT", Port, 1) == -1) {
+    if (setenv("SERVER_PORT", r->listener ? r->listener->port : Port, 1) == -1) {
         fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
     }
 
-    while (head != NULL) {
-        if (streq(head->name, "HTTP_HOST")) {
-            if (setenv("HTTP_HOST", head->value, 1) == -1) {
-                fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
-            }
+    /* Export well-known headers directly from the header table (and clear
+     * those left over from an earlier request) */
+    for (HeaderId id = 0; id < HEADER_KNOWN; id++) {
+        if (!r->known[id]) {
+            unsetenv(header_env(id));
+        } else if (setenv(header_env(id), r->known[id], 1) == -1) {
+            fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
+        }
+    }
+
+    /* Export other headers as HTTP_<NAME> */
+    for (Header *head = r->headers; head != NULL; head = head->next) {
+        char name[BUFSIZ];
+        if (strlen(head->name) + sizeof("HTTP_") > sizeof(name)) {
+            continue;
         }
 
-        if (streq(head->name, "HTTP_ACCEPT")) {
-            if (setenv("HTTP_ACCEPT", head->value, 1) == -1) {
-                fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
-            }
+        char *c = stpcpy(name, "HTTP_");
+        for (const char *n = head->name; *n; n++) {
+            *c++ = *n == '-' ? '_' : toupper((unsigned char)*n);
         }
+        *c = '\0';
 
-        if (streq(head->name, "HTTP_ACCEPT_LANGUAGE")) {
-            if (setenv("HTTP_ACCEPT_LANGUAGE", head->value, 1) == -1) {
-                fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
-            }
+        if (setenv(name, head->value, 1) == -1) {
+            fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
         }
+    }
+
+    /* Shed request if too many CGI processes are already running */
+    if (!admission_cgi_acquire()) {
+        admission_reject(r->fd);
+        return HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
+
+    /* Check request body against the route's limit before starting */
+    Body body;
+    HTTPStatus result = body_init(&body, r);
+    if (result != HTTP_STATUS_OK) {
+        admission_cgi_release();
+        return result;
+    }
+    if (body.chunked) {
+        unsetenv("CONTENT_LENGTH");
+    }
+
+    /* Start CGI Script */
+    int in, out;
+    pid_t pid = handle_cgi_spawn(r->path, &in, &out);
+    if (pid < 0) {
+        admission_cgi_release();
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
 
-        if (streq(head->name, "HTTP_ACCEPT_ENCODING")) {
-            if (setenv("HTTP_ACCEPT_ENCODING", head->value, 1) == -1) {
-                fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
+    /* Move body to script and output to socket until the script is done */
+    Response w;
+    char buffer[CGI_CHUNK_MAX];
+    size_t fill = 0;
+    ssize_t nread;
+    bool output = false;
+    uint64_t expires = CGIWallLimit > 0 ? timer_now() + CGIWallLimit * 1000ULL : 0;
+    response_init(&w, r->fd, r);
+    while (out >= 0) {
+        struct pollfd pfds[2] = {
+            { .fd = out, .events = POLLIN },
+            { .fd = -1 },
+        };
+
+        if (in >= 0) {
+            ssize_t moved = body_transfer(&body, in);
+            if (moved > 0) {
+                continue;
             }
+            if (moved < 0 && errno == EAGAIN) {
+                pfds[1].fd     = body.wait_fd;
+                pfds[1].events = body.wait_events;
+            } else {
+                /* Done, or the script stopped reading, or the body failed */
+                if (moved < 0 && errno != EPIPE) {
+                    debug("Could not stream request body: %s", strerror(errno));
+                    result = errno == E2BIG ? HTTP_STATUS_PAYLOAD_TOO_LARGE : (errno == ETIMEDOUT ? HTTP_STATUS_REQUEST_TIMEOUT : HTTP_STATUS_BAD_REQUEST);
+                    kill(-pid, SIGTERM);
+                }
+                close(in);
+                in = -1;
+                request_set_phase(r, PHASE_WRITE);
+            }
+        }
+
+        /* Wait for the body deadline (while reading it) or the write
+         * deadline (renewed by every chunk sent), never past the wall clock
+         * limit */
+        int64_t timeout = expires ? (int64_t)(expires - timer_now()) : -1;
+        if (expires && timeout < 0) {
+            timeout = 0;
+        }
+        if (request_poll(r, pfds, 2, timeout) < 0) {
+            debug("Could not poll: %s", strerror(errno));
+            break;
         }
 
-        if (streq(head->name, "HTTP_CONNECTION")) {
-            if (setenv("HTTP_CONNECTION", head->value, 1) == -1) {
-                fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
+        if (expires && timer_now() >= expires) {
+            log("CGI %s exceeded wall clock limit of %ds", r->path, CGIWallLimit);
+            if (result == HTTP_STATUS_OK) {
+                result = HTTP_STATUS_GATEWAY_TIMEOUT;
             }
+            break;
         }
 
-        if (streq(head->name, "HTTP_USER_AGENT")) {
-            if (setenv("HTTP_USER_AGENT", head->value, 1) == -1) {
-                fprintf(stderr, "Unable to setenv: %s\n", strerror(errno));
+        if (in < 0 && r->expired) {
+            log("CGI %s produced no output for %dms", r->path, WriteTimeout);
+            if (result == HTTP_STATUS_OK) {
+                result = HTTP_STATUS_GATEWAY_TIMEOUT;
             }
+            break;
+        }
+
+        if (!pfds[0].revents) {
+            continue;
         }
 
-        head = head->next;
-    }  
+        /* Drain what the script has written so far, so a slow script's
+         * bytes go out at once while a fast script's are batched into
+         * chunks of up to a full buffer */
+        nread = 1;
+        while (fill < sizeof(buffer) && (nread = read(out, buffer + fill, sizeof(buffer) - fill)) > 0) {
+            fill += nread;
+        }
+        bool idle = fill < sizeof(buffer);
+        if (nread == 0 || (nread < 0 && errno != EAGAIN && errno != EINTR)) {
+            close(out);
+            out = -1;
+        }
+        if (result != HTTP_STATUS_OK) {
+            fill = 0;
+            continue;
+        }
 
-    /* Export CGI environment variables from request headers */
-    Header *temp = r->headers;
-    while(temp != NULL) {
-	setenv(temp->name, temp->value, 1);
-	temp = temp->next;
+        /* Translate the header block into the response head */
+        size_t start = 0;
+        if (!output) {
+            ssize_t n = handle_cgi_headers(r, &w, buffer, fill);
+            if (n < 0 || (n == 0 && (out < 0 || !idle))) {
+                debug("Invalid CGI header block from %s", r->path);
+                result = HTTP_STATUS_BAD_GATEWAY;
+                fill   = 0;
+                continue;
+            }
+            if (n == 0) {
+                continue;
+            }
+            output = true;
+            start  = n;
+        }
+
+        /* Send chunk, uncorking the socket whenever the script goes idle */
+        if (response_chunk(&w, buffer + start, fill - start) < 0 || response_flush(&w, !idle && out >= 0) < 0) {
+            break;
+        }
+        fill = 0;
     }
 
-    /* POpen CGI Script */
-    FILE *ps = popen(r->path, "r");
+    /* Reap script, flush socket, return status */
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+        kill(-pid, result == HTTP_STATUS_GATEWAY_TIMEOUT ? SIGKILL : SIGTERM);
+    }
 
-    /* Copy data from popen to socket */
-    char buffer[BUFSIZ];
-    while(fgets(buffer, BUFSIZ, ps)) {
-	fputs(buffer, r->file);
+    struct rusage usage;
+    int status;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            memset(&usage, 0, sizeof(usage));
+            status = 0;
+            break;
+        }
     }
+    if (WIFSIGNALED(status)) {
+        log("CGI %s killed by signal %d", r->path, WTERMSIG(status));
+    }
+    stats_cgi(r, &usage, WIFSIGNALED(status));
+    admission_cgi_release();
+    if (output && out < 0 && result == HTTP_STATUS_OK) {
+        response_end_chunks(&w);
+    }
+    response_flush(&w, false);
+    return output ? HTTP_STATUS_OK : result;
+}
+
+/**
+ * Handle proxy request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   route       Proxy route matching request URI.
+ * @return  Status of the HTTP proxy request.
+ *
+ * This relays the request to an upstream server and streams its response
+ * back.  If no upstream responds, nothing is written and handle error should
+ * be used with the returned status.
+ **/
+HTTPStatus  handle_proxy_request(Request *r, const ProxyRoute *route) {
+    log("handle_proxy_request");
+    return proxy_forward(r, route);
+}
 
-    /* Close popen, flush socket, return OK */
-    pclose(ps);
-    fflush(r->file);
+/**
+ * Handle statistics request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP statistics request.
+ *
+ * This reports request counts and phase latencies aggregated over all
+ * workers as plain text.
+ **/
+HTTPStatus  handle_stats_request(Request *r) {
+    log("handle_stats_request");
+    Response w;
+    response_init(&w, r->fd, r);
+    response_status(&w, HTTP_STATUS_OK);
+    response_header(&w, "Content-Type", "text/plain");
+    response_header(&w, "Cache-Control", "no-store");
+    response_end_headers(&w);
+    stats_write(&w);
+    admission_report(&w);
+    request_report(&w);
+
+    if (response_flush(&w, false) < 0) {
+        debug("Could not flush, %s", strerror(errno));
+    }
     return HTTP_STATUS_OK;
 }
 
@@ -318,10 +962,15 @@ HTTPStatus  handle_error(Request *r, HTTPStatus status) {
     const char *status_string = http_status_string(status);
 
     /* Write HTTP Header */
-    fprintf(r->file, "HTTP/1.0 %s\n", status_string);
-    fprintf(r->file, "Content-type: text/html\n\n");
+    Response w;
+    response_init(&w, r->fd, r);
+    response_status(&w, status);
+    response_header(&w, "Content-Type", "text/html");
+    response_end_headers(&w);
+
     /* Write HTML Description of Error*/
-    fprintf(r->file, "<html><body> \"HTTP Status: %s\n\" </body></html>", status_string);
+    response_printf(&w, "<html><body> \"HTTP Status: %s\" </body></html>\r\n", status_string);
+    response_flush(&w, false);
 
     /* Return specified status */
     return status;
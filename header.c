@@ -0,0 +1,91 @@
+/* header.c: Well-Known Header Table */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <strings.h>
+
+/* Header names are interned with a perfect hash over the length, first and
+ * middle characters (case folded).  The bucket table is built from
+ * HEADER_LIST by header_init, which refuses to start if a name added to the
+ * list collides with another; HEADER_HASH must then be retuned. */
+
+#define HEADER_BUCKETS          64
+#define HEADER_HASH(s, n)       ((6 * (n) + ((s)[0] | 0x20) + ((s)[(n) / 2] | 0x20)) & (HEADER_BUCKETS - 1))
+
+typedef struct {
+    const char *name;                   /*< Canonical wire name */
+    size_t      length;                 /*< Length of name */
+    const char *env;                    /*< CGI environment variable */
+} HeaderName;
+
+#define HEADER_NAME(id, name, env)      [id] = { name, sizeof(name) - 1, env },
+
+static const HeaderName HeaderNames[HEADER_KNOWN] = {
+    HEADER_LIST(HEADER_NAME)
+};
+
+static uint8_t HeaderBuckets[HEADER_BUCKETS];  /* HeaderId + 1 (0 = empty) */
+
+/**
+ * Build header bucket table from HEADER_LIST.
+ *
+ * @return  -1 if two header names hash to the same bucket and 0 on success.
+ **/
+int header_init(void) {
+    memset(HeaderBuckets, 0, sizeof(HeaderBuckets));
+
+    for (HeaderId id = 0; id < HEADER_KNOWN; id++) {
+        const HeaderName *known  = &HeaderNames[id];
+        size_t            bucket = HEADER_HASH(known->name, known->length);
+
+        if (HeaderBuckets[bucket]) {
+            fprintf(stderr, "Unable to intern header %s: collides with %s in bucket %zu\n",
+                    known->name, HeaderNames[HeaderBuckets[bucket] - 1].name, bucket);
+            return -1;
+        }
+        HeaderBuckets[bucket] = id + 1;
+        debug("Header %s in bucket %zu", known->name, bucket);
+    }
+    return 0;
+}
+
+/**
+ * Intern header name.
+ *
+ * @param   name        Header name (any case, need not be NUL-terminated).
+ * @param   length      Length of name.
+ * @return  Header identifier or HEADER_KNOWN if the header is not known.
+ **/
+HeaderId header_lookup(const char *name, size_t length) {
+    if (length == 0) {
+        return HEADER_KNOWN;
+    }
+
+    uint8_t bucket = HeaderBuckets[HEADER_HASH(name, length)];
+    if (bucket == 0) {
+        return HEADER_KNOWN;
+    }
+
+    const HeaderName *known = &HeaderNames[bucket - 1];
+    if (known->length != length || strncasecmp(known->name, name, length) != 0) {
+        return HEADER_KNOWN;
+    }
+    return bucket - 1;
+}
+
+/**
+ * Return canonical name of known header.
+ **/
+const char * header_name(HeaderId id) {
+    return id < HEADER_KNOWN ? HeaderNames[id].name : NULL;
+}
+
+/**
+ * Return CGI environment variable of known header.
+ **/
+const char * header_env(HeaderId id) {
+    return id < HEADER_KNOWN ? HeaderNames[id].env : NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,486 @@
+/* hpack.c: HPACK Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+/* Static Table (RFC 7541 Appendix A) */
+
+static const char *StaticTable[][2] = {
+    { ":authority",                  ""              },
+    { ":method",                     "GET"           },
+    { ":method",                     "POST"          },
+    { ":path",                       "/"             },
+    { ":path",                       "/index.html"   },
+    { ":scheme",                     "http"          },
+    { ":scheme",                     "https"         },
+    { ":status",                     "200"           },
+    { ":status",                     "204"           },
+    { ":status",                     "206"           },
+    { ":status",                     "304"           },
+    { ":status",                     "400"           },
+    { ":status",                     "404"           },
+    { ":status",                     "500"           },
+    { "accept-charset",              ""              },
+    { "accept-encoding",             "gzip, deflate" },
+    { "accept-language",             ""              },
+    { "accept-ranges",               ""              },
+    { "accept",                      ""              },
+    { "access-control-allow-origin", ""              },
+    { "age",                         ""              },
+    { "allow",                       ""              },
+    { "authorization",               ""              },
+    { "cache-control",               ""              },
+    { "content-disposition",         ""              },
+    { "content-encoding",            ""              },
+    { "content-language",            ""              },
+    { "content-length",              ""              },
+    { "content-location",            ""              },
+    { "content-range",               ""              },
+    { "content-type",                ""              },
+    { "cookie",                      ""              },
+    { "date",                        ""              },
+    { "etag",                        ""              },
+    { "expect",                      ""              },
+    { "expires",                     ""              },
+    { "from",                        ""              },
+    { "host",                        ""              },
+    { "if-match",                    ""              },
+    { "if-modified-since",           ""              },
+    { "if-none-match",               ""              },
+    { "if-range",                    ""              },
+    { "if-unmodified-since",         ""              },
+    { "last-modified",               ""              },
+    { "link",                        ""              },
+    { "location",                    ""              },
+    { "max-forwards",                ""              },
+    { "proxy-authenticate",          ""              },
+    { "proxy-authorization",         ""              },
+    { "range",                       ""              },
+    { "referer",                     ""              },
+    { "refresh",                     ""              },
+    { "retry-after",                 ""              },
+    { "server",                      ""              },
+    { "set-cookie",                  ""              },
+    { "strict-transport-security",   ""              },
+    { "transfer-encoding",           ""              },
+    { "user-agent",                  ""              },
+    { "vary",                        ""              },
+    { "via",                         ""              },
+    { "www-authenticate",            ""              },
+};
+
+#define STATIC_ENTRIES  (sizeof(StaticTable) / sizeof(StaticTable[0]))
+#define ENTRY_OVERHEAD  32
+
+/* Huffman Code (RFC 7541 Appendix B)
+ *
+ * The code is canonical, so only the code length of each symbol (256 is
+ * EOS) is needed; codes are assigned in order of (length, symbol). */
+
+static const uint8_t HuffmanLengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+#define HUFFMAN_MAX_LENGTH  30
+#define HUFFMAN_EOS         256
+
+static uint32_t HuffmanFirst[HUFFMAN_MAX_LENGTH + 1];   /* First code of each length */
+static uint16_t HuffmanCount[HUFFMAN_MAX_LENGTH + 1];   /* Number of codes of each length */
+static uint16_t HuffmanOffset[HUFFMAN_MAX_LENGTH + 1];  /* Index of first symbol of each length */
+static uint16_t HuffmanSymbols[257];                    /* Symbols sorted by (length, symbol) */
+static bool     HuffmanReady = false;
+
+/**
+ * Build canonical Huffman decoding tables from code lengths.
+ **/
+static void hpack_huffman_init(void) {
+    uint32_t code = 0;
+    size_t   n    = 0;
+
+    for (int length = 1; length <= HUFFMAN_MAX_LENGTH; length++) {
+        HuffmanFirst[length]  = code;
+        HuffmanOffset[length] = n;
+        for (int symbol = 0; symbol < 257; symbol++) {
+            if (HuffmanLengths[symbol] == length) {
+                HuffmanSymbols[n++] = symbol;
+                HuffmanCount[length]++;
+            }
+        }
+        code = (code + HuffmanCount[length]) << 1;
+    }
+
+    HuffmanReady = true;
+}
+
+/**
+ * Decode Huffman encoded string.
+ *
+ * @param   data        Encoded octets.
+ * @param   length      Number of encoded octets.
+ * @return  Newly allocated NUL-terminated string or NULL on error.
+ **/
+static char * hpack_huffman_decode(const uint8_t *data, size_t length) {
+    /* Shortest code is 5 bits, so output is at most 8/5 of the input */
+    char    *s      = malloc(length * 8 / 5 + 2);
+    size_t   n      = 0;
+    uint32_t code   = 0;
+    int      bits   = 0;
+    bool     ones   = true;
+
+    if (!s) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        for (int b = 7; b >= 0; b--) {
+            int bit = (data[i] >> b) & 1;
+            code = (code << 1) | bit;
+            ones = ones && bit;
+            bits++;
+
+            if (code - HuffmanFirst[bits] < HuffmanCount[bits]) {
+                uint16_t symbol = HuffmanSymbols[HuffmanOffset[bits] + code - HuffmanFirst[bits]];
+                if (symbol == HUFFMAN_EOS) {
+                    goto fail;
+                }
+                s[n++] = symbol;
+                code   = 0;
+                bits   = 0;
+                ones   = true;
+            } else if (bits == HUFFMAN_MAX_LENGTH) {
+                goto fail;
+            }
+        }
+    }
+
+    /* Padding must be a prefix of EOS (all ones) shorter than 8 bits */
+    if (bits > 7 || !ones) {
+        goto fail;
+    }
+
+    s[n] = '\0';
+    return s;
+
+fail:
+    free(s);
+    return NULL;
+}
+
+/**
+ * Decode HPACK integer with N-bit prefix.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int hpack_decode_integer(const uint8_t **p, const uint8_t *end, int prefix, size_t *value) {
+    size_t mask = (1 << prefix) - 1;
+
+    if (*p >= end) {
+        return -1;
+    }
+
+    *value = *(*p)++ & mask;
+    if (*value < mask) {
+        return 0;
+    }
+
+    for (int shift = 0; shift < 28; shift += 7) {
+        if (*p >= end) {
+            return -1;
+        }
+        uint8_t b = *(*p)++;
+        *value += (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Decode HPACK string literal.
+ *
+ * @return  Newly allocated NUL-terminated string or NULL on error.
+ **/
+static char * hpack_decode_string(const uint8_t **p, const uint8_t *end) {
+    bool   huffman;
+    size_t length;
+    char  *s;
+
+    if (*p >= end) {
+        return NULL;
+    }
+    huffman = **p & 0x80;
+    if (hpack_decode_integer(p, end, 7, &length) < 0 || length > (size_t)(end - *p)) {
+        return NULL;
+    }
+
+    if (huffman) {
+        s = hpack_huffman_decode(*p, length);
+    } else if ((s = malloc(length + 1)) != NULL) {
+        memcpy(s, *p, length);
+        s[length] = '\0';
+    }
+
+    *p += length;
+    return s;
+}
+
+/**
+ * Evict oldest dynamic table entries until table fits within limit.
+ **/
+static void hpack_evict(HPACKTable *t, size_t limit) {
+    while (t->count > 0 && t->size > limit) {
+        size_t      oldest = (t->head + t->count - 1) % t->capacity;
+        HPACKEntry *e      = &t->entries[oldest];
+        t->size -= strlen(e->name) + strlen(e->value) + ENTRY_OVERHEAD;
+        free(e->name);
+        free(e->value);
+        t->count--;
+    }
+}
+
+/**
+ * Insert entry at the front of the dynamic table.
+ **/
+static void hpack_insert(HPACKTable *t, const char *name, const char *value) {
+    size_t size = strlen(name) + strlen(value) + ENTRY_OVERHEAD;
+
+    if (size > t->max_size) {
+        hpack_evict(t, 0);
+        return;
+    }
+
+    hpack_evict(t, t->max_size - size);
+    t->head = (t->head + t->capacity - 1) % t->capacity;
+    t->entries[t->head].name  = strdup(name);
+    t->entries[t->head].value = strdup(value);
+    t->count++;
+    t->size += size;
+}
+
+/**
+ * Lookup entry in combined static and dynamic index space.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int hpack_lookup(HPACKTable *t, size_t index, const char **name, const char **value) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= STATIC_ENTRIES) {
+        *name  = StaticTable[index - 1][0];
+        *value = StaticTable[index - 1][1];
+        return 0;
+    }
+
+    index -= STATIC_ENTRIES + 1;
+    if (index >= t->count) {
+        return -1;
+    }
+    *name  = t->entries[(t->head + index) % t->capacity].name;
+    *value = t->entries[(t->head + index) % t->capacity].value;
+    return 0;
+}
+
+/**
+ * Initialize HPACK decoding table.
+ *
+ * @param   t           HPACK table.
+ * @param   max_size    Maximum dynamic table size (SETTINGS_HEADER_TABLE_SIZE).
+ * @return  -1 on error and 0 on success.
+ **/
+int hpack_init(HPACKTable *t, size_t max_size) {
+    if (!HuffmanReady) {
+        hpack_huffman_init();
+    }
+
+    t->capacity = max_size / ENTRY_OVERHEAD + 1;
+    t->entries  = calloc(t->capacity, sizeof(HPACKEntry));
+    t->head     = 0;
+    t->count    = 0;
+    t->size     = 0;
+    t->max_size = max_size;
+    t->limit    = max_size;
+    return t->entries ? 0 : -1;
+}
+
+/**
+ * Release HPACK decoding table.
+ **/
+void hpack_free(HPACKTable *t) {
+    hpack_evict(t, 0);
+    free(t->entries);
+    t->entries = NULL;
+}
+
+/**
+ * Decode header block.
+ *
+ * @param   t           HPACK table.
+ * @param   data        Header block fragment(s), concatenated.
+ * @param   length      Length of header block.
+ * @param   emit        Function called for each decoded header.
+ * @param   ctx         Context for emit.
+ * @return  -1 on compression error and 0 on success.
+ **/
+int hpack_decode(HPACKTable *t, const uint8_t *data, size_t length, HPACKEmit emit, void *ctx) {
+    const uint8_t *p   = data;
+    const uint8_t *end = data + length;
+
+    while (p < end) {
+        const char *name  = NULL;
+        const char *value = NULL;
+        char       *sname = NULL;
+        char       *svalue = NULL;
+        size_t      index;
+        bool        indexing = false;
+
+        if (*p & 0x80) {                        /* Indexed header field */
+            if (hpack_decode_integer(&p, end, 7, &index) < 0 || hpack_lookup(t, index, &name, &value) < 0) {
+                return -1;
+            }
+        } else if ((*p & 0xe0) == 0x20) {       /* Dynamic table size update */
+            if (hpack_decode_integer(&p, end, 5, &index) < 0 || index > t->limit) {
+                return -1;
+            }
+            t->max_size = index;
+            hpack_evict(t, t->max_size);
+            continue;
+        } else {                                /* Literal header field */
+            int prefix = (*p & 0x40) ? 6 : 4;
+            indexing   = (*p & 0x40);
+
+            if (hpack_decode_integer(&p, end, prefix, &index) < 0) {
+                return -1;
+            }
+            if (index == 0) {
+                if ((name = sname = hpack_decode_string(&p, end)) == NULL) {
+                    return -1;
+                }
+            } else if (hpack_lookup(t, index, &name, &value) < 0) {
+                return -1;
+            }
+            if ((value = svalue = hpack_decode_string(&p, end)) == NULL) {
+                free(sname);
+                return -1;
+            }
+        }
+
+        /* Emit before inserting: insertion may evict the entry name refers to */
+        emit(ctx, name, value);
+        if (indexing) {
+            char *n = strdup(name);
+            hpack_insert(t, n, value);
+            free(n);
+        }
+        free(sname);
+        free(svalue);
+    }
+
+    return 0;
+}
+
+/**
+ * Encode HPACK integer with N-bit prefix.
+ **/
+static size_t hpack_encode_integer(uint8_t *out, uint8_t first, int prefix, size_t value) {
+    size_t mask = (1 << prefix) - 1;
+    size_t n    = 0;
+
+    if (value < mask) {
+        out[n++] = first | value;
+        return n;
+    }
+
+    out[n++] = first | mask;
+    value   -= mask;
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7f) | 0x80;
+        value  >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+/**
+ * Encode response status.
+ *
+ * @param   out         Output buffer (at least 8 bytes).
+ * @param   status      Numeric HTTP status code.
+ * @return  Number of bytes written.
+ **/
+size_t hpack_encode_status(uint8_t *out, int status) {
+    char   value[8];
+    size_t n;
+
+    if (status < 100 || status > 999) {
+        status = 500;
+    }
+
+    for (size_t i = 7; i < 14; i++) {
+        if (atoi(StaticTable[i][1]) == status) {
+            return hpack_encode_integer(out, 0x80, 7, i + 1);
+        }
+    }
+
+    /* Literal without indexing, indexed name ":status" */
+    snprintf(value, sizeof(value), "%d", status);
+    n  = hpack_encode_integer(out, 0x00, 4, 8);
+    n += hpack_encode_integer(out + n, 0x00, 7, 3);
+    memcpy(out + n, value, 3);
+    return n + 3;
+}
+
+/**
+ * Encode header as literal without indexing (no Huffman coding).
+ *
+ * @param   out         Output buffer (at least strlen(name) + strlen(value) + 16 bytes).
+ * @param   name        Header name (lowercased on output).
+ * @param   value       Header value.
+ * @return  Number of bytes written.
+ **/
+size_t hpack_encode_header(uint8_t *out, const char *name, const char *value) {
+    size_t nlength = strlen(name);
+    size_t vlength = strlen(value);
+    size_t n       = 0;
+
+    /* Use static name index where available */
+    for (size_t i = 14; i < STATIC_ENTRIES; i++) {
+        if (strcasecmp(StaticTable[i][0], name) == 0) {
+            n = hpack_encode_integer(out, 0x00, 4, i + 1);
+            goto value;
+        }
+    }
+
+    out[n++] = 0x00;
+    n += hpack_encode_integer(out + n, 0x00, 7, nlength);
+    for (size_t i = 0; i < nlength; i++) {
+        out[n++] = tolower((unsigned char)name[i]);
+    }
+
+value:
+    n += hpack_encode_integer(out + n, 0x00, 7, vlength);
+    memcpy(out + n, value, vlength);
+    return n + vlength;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,226 @@
+/* iopool.c: File I/O Thread Pool */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+/* Reading a file that is not in the page cache blocks the thread serving the
+ * connection on the disk.  Tasks submitted here are run by a small pool of
+ * threads instead, so the serving thread can go on writing what it already
+ * has: large files are read a block ahead of the socket, and readahead for
+ * the whole file is requested as soon as its path is resolved.
+ *
+ * A task's completion is posted to the eventfd named in the task, which the
+ * connection may poll along with its socket (iopool_wait simply blocks on
+ * it); a connection has at most one task outstanding per eventfd.  If there
+ * is no pool (IOThreads is 0) or its queue is full, tasks run inline, so
+ * submitting always succeeds.
+ *
+ * Threads do not survive fork, so each process starts its own pool the first
+ * time it submits work; in forking mode, only workers serving large files
+ * ever do. */
+
+#define IOPOOL_QUEUE    64              /* Maximum queued tasks */
+
+static pthread_mutex_t Lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  Ready    = PTHREAD_COND_INITIALIZER;
+static IOTask         *Head     = NULL;
+static IOTask         *Tail     = NULL;
+static size_t          Queued   = 0;
+static pid_t           Owner    = 0;
+static bool            Running  = false;
+
+/**
+ * Run task and post its completion.
+ **/
+static void iopool_run(IOTask *t) {
+    switch (t->op) {
+        case IO_READ:
+            do {
+                t->result = pread(t->fd, t->buffer, t->length, t->offset);
+            } while (t->result < 0 && errno == EINTR);
+            t->error = t->result < 0 ? errno : 0;
+            break;
+
+        case IO_ADVISE: {
+            int fd = open(t->path, O_RDONLY | O_CLOEXEC);
+            t->result = fd < 0 ? -1 : posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            t->error  = fd < 0 ? errno : (int)t->result;
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+    }
+
+    /* Detached tasks (readahead) belong to the pool */
+    if (t->notify < 0) {
+        free((char *)t->path);
+        free(t);
+        return;
+    }
+
+    /* Posting is the last touch: the waiter may release the task (and its
+     * eventfd) as soon as it sees the completion */
+    uint64_t one = 1;
+    while (write(t->notify, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+/**
+ * Take tasks off the queue and run them.
+ **/
+static void * iopool_worker(void *arg) {
+    while (true) {
+        pthread_mutex_lock(&Lock);
+        while (!Head) {
+            pthread_cond_wait(&Ready, &Lock);
+        }
+        IOTask *t = Head;
+        Head = t->next;
+        if (!Head) {
+            Tail = NULL;
+        }
+        Queued--;
+        pthread_mutex_unlock(&Lock);
+
+        iopool_run(t);
+    }
+    return NULL;
+}
+
+/**
+ * Start pool threads for this process (once).
+ *
+ * @return  -1 if there is no pool and 0 on success.
+ **/
+static int iopool_start(void) {
+    pthread_t thread;
+    sigset_t  all, old;
+
+    if (Owner == getpid()) {
+        return Running ? 0 : -1;
+    }
+
+    /* Anything inherited from the parent's pool belongs to the parent */
+    Owner   = getpid();
+    Running = false;
+    Head    = Tail = NULL;
+    Queued  = 0;
+    pthread_mutex_init(&Lock, NULL);
+    pthread_cond_init(&Ready, NULL);
+
+    /* Workers take no signals; those are handled by the serving thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (size_t i = 0; i < IOThreads; i++) {
+        int error = pthread_create(&thread, NULL, iopool_worker, NULL);
+        if (error) {
+            fprintf(stderr, "Unable to pthread_create: %s\n", strerror(error));
+            break;
+        }
+        pthread_detach(thread);
+        Running = true;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return Running ? 0 : -1;
+}
+
+/**
+ * Queue task for the pool.
+ *
+ * @return  -1 if the task was not queued and 0 on success.
+ **/
+static int iopool_queue(IOTask *t) {
+    if (iopool_start() < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&Lock);
+    if (Queued == IOPOOL_QUEUE) {
+        pthread_mutex_unlock(&Lock);
+        return -1;
+    }
+    t->next = NULL;
+    if (Tail) {
+        Tail->next = t;
+    } else {
+        Head = t;
+    }
+    Tail = t;
+    Queued++;
+    pthread_cond_signal(&Ready);
+    pthread_mutex_unlock(&Lock);
+    return 0;
+}
+
+/**
+ * Submit task.
+ *
+ * @param   t           Task (must stay valid until it is done).
+ *
+ * The task runs on a pool thread, or inline if it cannot be queued; either
+ * way its completion is posted to t->notify.
+ **/
+void iopool_submit(IOTask *t) {
+    t->result = -1;
+    t->error  = 0;
+
+    if (iopool_queue(t) < 0) {
+        iopool_run(t);
+    }
+}
+
+/**
+ * Wait for task to complete.
+ *
+ * @param   t           Submitted task.
+ * @return  Result of task (errno is set on failure).
+ **/
+ssize_t iopool_wait(IOTask *t) {
+    uint64_t count;
+
+    while (read(t->notify, &count, sizeof(count)) < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+        struct pollfd pfd = { .fd = t->notify, .events = POLLIN };
+        poll(&pfd, 1, -1);
+    }
+
+    errno = t->error;
+    return t->result;
+}
+
+/**
+ * Request readahead of whole file in the background.
+ *
+ * @param   path        Path of file.
+ *
+ * This never blocks the caller: without a free pool thread, the hint is
+ * dropped (the file is still read, just without readahead).
+ **/
+void iopool_advise(const char *path) {
+    IOTask *t = calloc(1, sizeof(IOTask));
+    if (!t || !(t->path = strdup(path))) {
+        free(t);
+        return;
+    }
+
+    t->op     = IO_ADVISE;
+    t->notify = -1;
+    if (iopool_queue(t) < 0) {
+        free((char *)t->path);
+        free(t);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,803 @@
+/* proxy.c: Reverse Proxy */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Requests whose URI starts with a route prefix are relayed to one of the
+ * route's upstream HTTP/1.1 servers.  Each worker keeps idle keep-alive
+ * connections to every upstream and reuses them for later requests (and
+ * HTTP/2 streams) it handles.  Since client connections are not kept alive,
+ * a forking worker only reuses them across the streams of an HTTP/2
+ * connection; the single server reuses them across all requests.  In-flight counts and passive health (an
+ * upstream is skipped for PROXY_COOLDOWN after PROXY_FAILURES consecutive
+ * connection or protocol failures) live in shared memory, so balancing and
+ * ejection are consistent across workers.  Bodies are relayed a buffer at
+ * a time in both directions. */
+
+#define PROXY_ROUTES        8           /* Maximum number of routes */
+#define PROXY_UPSTREAMS     32          /* Maximum number of upstreams (all routes) */
+#define PROXY_POOL          8           /* Idle connections kept per upstream (per worker) */
+#define PROXY_FAILURES      3           /* Consecutive failures before ejection */
+#define PROXY_COOLDOWN      10000       /* Milliseconds an ejected upstream is skipped */
+#define PROXY_LINE          8192        /* Maximum upstream status or header line */
+
+typedef struct {
+    struct sockaddr_storage addr;       /*< Upstream address */
+    socklen_t   length;                 /*< Length of address */
+    char        name[NI_MAXHOST + NI_MAXSERV + 8]; /*< Upstream as configured */
+    int         idle[PROXY_POOL];       /*< Idle keep-alive connections */
+    size_t      nidle;                  /*< Number of idle connections */
+} ProxyUpstream;
+
+struct proxy_route {
+    char       *prefix;                 /*< URI prefix */
+    size_t      length;                 /*< Length of prefix */
+    bool        least;                  /*< Least connections (otherwise round robin) */
+    size_t      index;                  /*< Index of route */
+    size_t      first;                  /*< First upstream of route */
+    size_t      count;                  /*< Number of upstreams */
+};
+
+typedef struct {
+    size_t      active;                 /*< In-flight requests (all workers) */
+    size_t      failures;               /*< Consecutive failures */
+    uint64_t    down_until;             /*< Skipped until (timer_now) */
+} ProxyHealth;
+
+typedef struct {
+    size_t      next[PROXY_ROUTES];     /*< Round robin positions */
+    ProxyHealth health[PROXY_UPSTREAMS];/*< Upstream health */
+} ProxyShared;
+
+typedef struct {
+    int         fd;                     /*< Upstream connection */
+    size_t      start;                  /*< Offset of unread data */
+    size_t      end;                    /*< End of buffered data */
+    char        buffer[BUFSIZ];         /*< Read buffer */
+} ProxyReader;
+
+static ProxyRoute     Routes[PROXY_ROUTES];
+static size_t         NRoutes    = 0;
+static ProxyUpstream  Upstreams[PROXY_UPSTREAMS];
+static size_t         NUpstreams = 0;
+static ProxyShared   *Shared     = NULL;
+
+/* Configuration */
+
+/**
+ * Resolve upstream address.
+ *
+ * @param   spec        host:port, [v6]:port, or unix:/path.
+ * @param   u           Upstream to fill in.
+ * @return  -1 on error and 0 on success.
+ **/
+static int proxy_resolve(const char *spec, ProxyUpstream *u) {
+    char host[NI_MAXHOST];
+    const char *port;
+
+    if (strlen(spec) >= sizeof(u->name)) {
+        return -1;
+    }
+    strcpy(u->name, spec);
+    u->nidle = 0;
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&u->addr;
+        if (strlen(spec + 5) >= sizeof(sun->sun_path)) {
+            return -1;
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, spec + 5);
+        u->length = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    if (spec[0] == '[') {
+        const char *close = strchr(spec, ']');
+        if (!close || close[1] != ':' || (size_t)(close - spec - 1) >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, spec + 1, close - spec - 1);
+        host[close - spec - 1] = '\0';
+        port = close + 2;
+    } else {
+        const char *colon = strrchr(spec, ':');
+        if (!colon || (size_t)(colon - spec) >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, spec, colon - spec);
+        host[colon - spec] = '\0';
+        port = colon + 1;
+    }
+
+    struct addrinfo  hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *results;
+    int status;
+    if ((status = getaddrinfo(host, port, &hints, &results)) != 0) {
+        fprintf(stderr, "Unable to resolve upstream %s: %s\n", spec, gai_strerror(status));
+        return -1;
+    }
+    memcpy(&u->addr, results->ai_addr, results->ai_addrlen);
+    u->length = results->ai_addrlen;
+    freeaddrinfo(results);
+    return 0;
+}
+
+/**
+ * Parse reverse proxy routes and allocate state shared by all workers.
+ *
+ * @param   specs       Comma separated routes: prefix=[lc:|rr:]upstream[+upstream...],
+ *                      where each upstream is host:port, [v6]:port, or
+ *                      unix:/path.  Upstreams are balanced round robin
+ *                      (rr, the default) or by least connections (lc).
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked.
+ **/
+int proxy_init(const char *specs) {
+    char *copy = strdup(specs);
+    char *save = NULL;
+
+    if (!copy) {
+        return -1;
+    }
+
+    for (char *spec = strtok_r(copy, ",", &save); spec; spec = strtok_r(NULL, ",", &save)) {
+        char *equal    = strchr(spec, '=');
+        char *upstream = NULL;
+        char *next     = NULL;
+
+        if (!equal || equal == spec || NRoutes == PROXY_ROUTES) {
+            fprintf(stderr, "Invalid proxy route: %s\n", spec);
+            goto fail;
+        }
+        *equal++ = '\0';
+
+        ProxyRoute *route = &Routes[NRoutes];
+        route->prefix = strdup(spec);
+        route->length = strlen(spec);
+        route->least  = strncmp(equal, "lc:", 3) == 0;
+        route->index  = NRoutes;
+        route->first  = NUpstreams;
+        route->count  = 0;
+        if (strncmp(equal, "lc:", 3) == 0 || strncmp(equal, "rr:", 3) == 0) {
+            equal += 3;
+        }
+
+        for (upstream = strtok_r(equal, "+", &next); upstream; upstream = strtok_r(NULL, "+", &next)) {
+            if (NUpstreams == PROXY_UPSTREAMS || proxy_resolve(upstream, &Upstreams[NUpstreams]) < 0) {
+                fprintf(stderr, "Invalid upstream: %s\n", upstream);
+                goto fail;
+            }
+            NUpstreams++;
+            route->count++;
+        }
+
+        if (route->count == 0) {
+            fprintf(stderr, "Proxy route %s has no upstreams\n", route->prefix);
+            goto fail;
+        }
+        NRoutes++;
+    }
+
+    void *map = mmap(NULL, sizeof(ProxyShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to mmap proxy state: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    Shared = map;
+    free(copy);
+    return 0;
+
+fail:
+    free(copy);
+    return -1;
+}
+
+/**
+ * Find route with the longest prefix matching URI.
+ *
+ * @return  Route or NULL if URI is not proxied.
+ **/
+const ProxyRoute * proxy_lookup(const char *uri) {
+    const ProxyRoute *match = NULL;
+
+    for (size_t i = 0; i < NRoutes; i++) {
+        if (strncmp(uri, Routes[i].prefix, Routes[i].length) == 0 && (!match || Routes[i].length > match->length)) {
+            match = &Routes[i];
+        }
+    }
+    return match;
+}
+
+/* Upstream Selection and Health */
+
+/**
+ * Choose upstream for route, skipping those already tried.
+ *
+ * @return  Index of upstream or -1 if all have been tried.
+ *
+ * Ejected upstreams are only chosen when every untried upstream is ejected
+ * (the one that comes back soonest is tried first).
+ **/
+static ssize_t proxy_select(const ProxyRoute *route, uint32_t tried) {
+    size_t   offset   = __atomic_fetch_add(&Shared->next[route->index], 1, __ATOMIC_RELAXED);
+    uint64_t now      = timer_now();
+    ssize_t  best     = -1;
+    ssize_t  fallback = -1;
+
+    for (size_t i = 0; i < route->count; i++) {
+        size_t       index = route->first + (offset + i) % route->count;
+        ProxyHealth *h     = &Shared->health[index];
+
+        if (tried & (1U << index)) {
+            continue;
+        }
+
+        if (__atomic_load_n(&h->down_until, __ATOMIC_RELAXED) > now) {
+            if (fallback < 0 || h->down_until < Shared->health[fallback].down_until) {
+                fallback = index;
+            }
+            continue;
+        }
+
+        if (!route->least) {
+            return index;
+        }
+        if (best < 0 || __atomic_load_n(&h->active, __ATOMIC_RELAXED) < __atomic_load_n(&Shared->health[best].active, __ATOMIC_RELAXED)) {
+            best = index;
+        }
+    }
+
+    return best >= 0 ? best : fallback;
+}
+
+/**
+ * Record failed exchange with upstream, ejecting it after repeated failures.
+ **/
+static void proxy_failed(size_t index) {
+    ProxyHealth *h = &Shared->health[index];
+
+    if (__atomic_add_fetch(&h->failures, 1, __ATOMIC_RELAXED) >= PROXY_FAILURES) {
+        __atomic_store_n(&h->down_until, timer_now() + PROXY_COOLDOWN, __ATOMIC_RELAXED);
+        log("Upstream %s ejected for %d ms", Upstreams[index].name, PROXY_COOLDOWN);
+    }
+}
+
+/**
+ * Record successful exchange with upstream.
+ **/
+static void proxy_succeeded(size_t index) {
+    ProxyHealth *h = &Shared->health[index];
+
+    if (__atomic_load_n(&h->failures, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->failures, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->down_until, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* Upstream Connections */
+
+/**
+ * Open connection to upstream.
+ *
+ * @return  Connected socket or -1 on error.
+ *
+ * The connect is bounded by ConnectTimeout and every later read and write
+ * on the (blocking) connection by UpstreamTimeout.
+ **/
+static int proxy_connect(const ProxyUpstream *u) {
+    struct timeval timeout = { UpstreamTimeout / 1000, (UpstreamTimeout % 1000) * 1000 };
+    int    error  = 0;
+    socklen_t size = sizeof(error);
+
+    int fd = socket(u->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        debug("Unable to make socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (const struct sockaddr *)&u->addr, u->length) < 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        if (errno != EINPROGRESS || poll(&pfd, 1, ConnectTimeout > 0 ? ConnectTimeout : -1) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) < 0 || error) {
+            debug("Unable to connect to %s: %s", u->name, strerror(error ? error : errno ? errno : ETIMEDOUT));
+            close(fd);
+            return -1;
+        }
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (u->addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/**
+ * Take idle connection to upstream from the pool, or open a new one.
+ *
+ * @param   u           Upstream.
+ * @param   reused      Set if the connection came from the pool.
+ * @return  Connected socket or -1 on error.
+ **/
+static int proxy_acquire(ProxyUpstream *u, bool *reused) {
+    char byte;
+
+    while (u->nidle > 0) {
+        int fd = u->idle[--u->nidle];
+
+        /* Discard connections the upstream has since closed */
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *reused = true;
+            return fd;
+        }
+        close(fd);
+    }
+
+    *reused = false;
+    return proxy_connect(u);
+}
+
+/**
+ * Return connection to the pool (or close it if the pool is full).
+ **/
+static void proxy_release(ProxyUpstream *u, int fd) {
+    if (u->nidle < PROXY_POOL) {
+        u->idle[u->nidle++] = fd;
+    } else {
+        close(fd);
+    }
+}
+
+/**
+ * Write all of buffer to upstream.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int proxy_send(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data   += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/* Upstream Responses */
+
+/**
+ * Read more data from upstream into reader.
+ *
+ * @return  Number of bytes read (0 at end of stream) or -1 on error.
+ **/
+static ssize_t proxy_fill(ProxyReader *u) {
+    if (u->start == u->end) {
+        u->start = u->end = 0;
+    } else if (u->end == sizeof(u->buffer)) {
+        memmove(u->buffer, u->buffer + u->start, u->end - u->start);
+        u->end  -= u->start;
+        u->start = 0;
+    }
+
+    ssize_t n;
+    do {
+        n = recv(u->fd, u->buffer + u->end, sizeof(u->buffer) - u->end, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) {
+        u->end += n;
+    }
+    return n;
+}
+
+/**
+ * Read line from upstream (without CRLF).
+ *
+ * @return  Length of line or -1 on error, end of stream, or overlong line.
+ **/
+static ssize_t proxy_line(ProxyReader *u, char *line, size_t size) {
+    size_t length = 0;
+
+    while (true) {
+        char  *start = u->buffer + u->start;
+        char  *eol   = memchr(start, '\n', u->end - u->start);
+        size_t n     = eol ? (size_t)(eol - start) + 1 : u->end - u->start;
+
+        if (length + n >= size) {
+            return -1;
+        }
+        memcpy(line + length, start, n);
+        length   += n;
+        u->start += n;
+
+        if (eol) {
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+                length--;
+            }
+            line[length] = '\0';
+            return length;
+        }
+        if (proxy_fill(u) <= 0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Relay up to length body bytes from upstream to client.
+ *
+ * @param   u           Upstream reader.
+ * @param   w           Client response writer.
+ * @param   length      Number of bytes to relay (SIZE_MAX for end of stream).
+ * @param   client      Cleared if the client stops accepting data.
+ * @return  -1 on upstream error and 0 on success.
+ *
+ * After the client goes away the remaining bytes are still read so the
+ * upstream connection stays usable.
+ **/
+static int proxy_relay(ProxyReader *u, Response *w, size_t length, bool *client) {
+    while (length > 0) {
+        if (u->start == u->end) {
+            ssize_t n = proxy_fill(u);
+            if (n < 0 || (n == 0 && length != SIZE_MAX)) {
+                return -1;
+            }
+            if (n == 0) {
+                return 0;
+            }
+        }
+
+        size_t n = u->end - u->start;
+        if (n > length) {
+            n = length;
+        }
+        if (*client && (response_append(w, u->buffer + u->start, n) < 0 || response_flush(w, true) < 0)) {
+            *client = false;
+        }
+        u->start += n;
+        if (length != SIZE_MAX) {
+            length -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Relay chunked body from upstream to client (decoded).
+ *
+ * @return  -1 on upstream error and 0 on success.
+ **/
+static int proxy_relay_chunked(ProxyReader *u, Response *w, bool *client) {
+    char line[PROXY_LINE];
+
+    while (true) {
+        char  *end;
+        if (proxy_line(u, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        size_t size = strtoul(line, &end, 16);
+        if (end == line) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (proxy_relay(u, w, size, client) < 0 || proxy_line(u, line, sizeof(line)) != 0) {
+            return -1;
+        }
+    }
+
+    /* Discard trailers */
+    ssize_t n;
+    while ((n = proxy_line(u, line, sizeof(line))) > 0);
+    return n == 0 ? 0 : -1;
+}
+
+/**
+ * Determine whether upstream header is hop-by-hop (not relayed).
+ **/
+static bool proxy_hop_header(const char *name, size_t length) {
+    static const char *Hop[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+        "Transfer-Encoding", "Upgrade", "Server",
+    };
+
+    for (size_t i = 0; i < sizeof(Hop) / sizeof(Hop[0]); i++) {
+        if (strlen(Hop[i]) == length && strncasecmp(name, Hop[i], length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Exchange */
+
+/**
+ * Send request line, headers and body to upstream.
+ *
+ * @return  -1 on upstream error, -2 on client error, and 0 on success.
+ **/
+static int proxy_send_request(int fd, Request *r, const ProxyUpstream *u, size_t body) {
+    const char *forwarded = request_header(r, HEADER_X_FORWARDED_FOR);
+    const char *host      = request_header(r, HEADER_HOST);
+    char        client[REQUEST_HOST_MAX];
+    char       *head      = NULL;
+    size_t      length    = 0;
+    FILE       *stream    = open_memstream(&head, &length);
+
+    if (!stream) {
+        return -1;
+    }
+
+    fprintf(stream, "%s %s%s%s HTTP/1.1\r\n", r->method, r->uri, r->query ? "?" : "", r->query ? r->query : "");
+    fprintf(stream, "Host: %s\r\n", host ? host : u->name);
+    for (HeaderId id = 0; id < HEADER_KNOWN; id++) {
+        switch (id) {
+            case HEADER_CONNECTION: case HEADER_CONTENT_LENGTH: case HEADER_EXPECT: case HEADER_HOST:
+            case HEADER_HTTP2_SETTINGS: case HEADER_TE: case HEADER_TRANSFER_ENCODING: case HEADER_UPGRADE:
+            case HEADER_X_FORWARDED_FOR:
+                continue;
+            default:
+                if (r->known[id]) {
+                    fprintf(stream, "%s: %s\r\n", header_name(id), r->known[id]);
+                }
+                break;
+        }
+    }
+    for (Header *header = r->headers; header; header = header->next) {
+        if (!proxy_hop_header(header->name, strlen(header->name))) {
+            fprintf(stream, "%s: %s\r\n", header->name, header->value);
+        }
+    }
+    if (body > 0 || request_header(r, HEADER_CONTENT_LENGTH)) {
+        fprintf(stream, "Content-Length: %zu\r\n", body);
+    }
+    fprintf(stream, "X-Forwarded-For: %s%s%s\r\n", forwarded ? forwarded : "", forwarded ? ", " : "", request_host(r, client, sizeof(client)));
+    fprintf(stream, "X-Forwarded-Proto: http\r\n\r\n");
+    fclose(stream);
+
+    int status = head ? proxy_send(fd, head, length) : -1;
+    free(head);
+    if (status < 0 || body == 0) {
+        return status;
+    }
+
+    /* Stream request body from client to upstream */
+    char buffer[BUFSIZ];
+    request_set_phase(r, PHASE_BODY);
+    while (body > 0) {
+        size_t n = request_read(r, buffer, body < sizeof(buffer) ? body : sizeof(buffer));
+        if (n == 0) {
+            request_set_phase(r, PHASE_WRITE);
+            return -2;
+        }
+        if (proxy_send(fd, buffer, n) < 0) {
+            request_set_phase(r, PHASE_WRITE);
+            return -1;
+        }
+        body -= n;
+    }
+    request_set_phase(r, PHASE_WRITE);
+    return 0;
+}
+
+/**
+ * Relay upstream response to client.
+ *
+ * @return  -1 if the upstream failed before anything was written to the
+ *          client, -2 if it failed after part of the response headers were
+ *          already flushed, 1 if the connection may be reused, and 0
+ *          otherwise.
+ *
+ * Long upstream headers may be flushed to the client before the header
+ * block ends (see response_copy), so only a -1 may be retried.
+ **/
+static int proxy_relay_response(ProxyReader *u, Request *r, int *code) {
+    char     line[PROXY_LINE];
+    char    *reason;
+    bool     keepalive;
+    bool     chunked;
+    bool     client = true;
+    size_t   length;
+    Response w;
+
+    response_init(&w, r->fd, r);
+
+    /* Skip interim (1xx) responses */
+    do {
+        if (proxy_line(u, line, sizeof(line)) < 12 || strncmp(line, "HTTP/1.", 7) != 0) {
+            return -1;
+        }
+        *code     = strtol(line + 9, &reason, 10);
+        keepalive = line[7] == '1';
+        chunked   = false;
+        length    = SIZE_MAX;
+        if (*code < 100 || *code > 999) {
+            return -1;
+        }
+        reason += *reason == ' ';
+
+        if (*code >= 200 && response_status_code(&w, *code, reason) < 0) {
+            client = false;
+        }
+
+        ssize_t n;
+        while ((n = proxy_line(u, line, sizeof(line))) > 0) {
+            char  *colon = strchr(line, ':');
+            if (!colon) {
+                return w.sent ? -2 : -1;
+            }
+            char  *value = colon + 1 + strspn(colon + 1, " \t");
+            size_t nlen  = colon - line;
+
+            if (nlen == 10 && strncasecmp(line, "Connection", 10) == 0) {
+                keepalive = strcasestr(value, "close") ? false : (strcasestr(value, "keep-alive") ? true : keepalive);
+            } else if (nlen == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+                chunked = strcasestr(value, "chunked") != NULL;
+            } else if (nlen == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+                length = strtoul(value, NULL, 10);
+            }
+
+            if (*code >= 200 && client && !proxy_hop_header(line, nlen) &&
+                (response_copy(&w, line, n) < 0 || response_copy(&w, "\r\n", 2) < 0)) {
+                client = false;
+            }
+        }
+        if (n < 0) {
+            return w.sent ? -2 : -1;
+        }
+    } while (*code < 200);
+
+    if (client && response_end_headers(&w) < 0) {
+        client = false;
+    }
+
+    /* Relay body, which is delimited by the chunked encoding, its length,
+     * or the end of the connection */
+    int status = 0;
+    if (streq(r->method, "HEAD") || *code == 204 || *code == 304) {
+        length = 0;
+    } else if (chunked) {
+        status = proxy_relay_chunked(u, &w, &client);
+        length = 0;
+    }
+    if (status == 0 && length > 0) {
+        if (length == SIZE_MAX) {
+            keepalive = false;
+        }
+        status = proxy_relay(u, &w, length, &client);
+    }
+
+    if (client) {
+        response_flush(&w, false);
+    }
+    return status == 0 && keepalive && u->start == u->end ? 1 : 0;
+}
+
+/**
+ * Relay request to one of the route's upstreams and relay the response back.
+ *
+ * @param   r           Request structure.
+ * @param   route       Route matching request URI.
+ * @return  Status of the proxied request (HTTP_STATUS_OK once an upstream
+ *          response has been relayed, whose code is kept in r->upstream).
+ *
+ * A request without a body is retried on a fresh connection, or another
+ * upstream, if the upstream fails before responding; pooled connections
+ * may have been closed by the upstream at any time.  Once any part of the
+ * response has reached the client it is never retried: the client
+ * connection is shut down instead so the truncated response cannot be
+ * mistaken for a complete one.  Request bodies must have a Content-Length.
+ **/
+HTTPStatus proxy_forward(Request *r, const ProxyRoute *route) {
+    const char *content_length = request_header(r, HEADER_CONTENT_LENGTH);
+    size_t      body           = 0;
+    uint32_t    tried          = 0;
+    HTTPStatus  status         = HTTP_STATUS_BAD_GATEWAY;
+
+    if (content_length) {
+        char *end;
+        errno = 0;
+        unsigned long long n = strtoull(content_length, &end, 10);
+        if (errno || end == content_length || *end != '\0' || content_length[0] == '-' || n > SIZE_MAX) {
+            debug("Invalid Content-Length: %s", content_length);
+            return HTTP_STATUS_BAD_REQUEST;
+        }
+        body = n;
+    }
+
+    if (request_header(r, HEADER_TRANSFER_ENCODING) || (body > 0 && r->version == 20)) {
+        debug("Unable to proxy request body without Content-Length");
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+
+    for (size_t attempt = 0; attempt <= route->count; attempt++) {
+        ssize_t index = proxy_select(route, tried);
+        if (index < 0) {
+            break;
+        }
+
+        ProxyUpstream *u = &Upstreams[index];
+        ProxyReader    reader = { .fd = -1 };
+        bool           reused;
+        int            code   = 0;
+        int            result = -1;
+
+        __atomic_add_fetch(&Shared->health[index].active, 1, __ATOMIC_RELAXED);
+        errno = 0;
+        if ((reader.fd = proxy_acquire(u, &reused)) >= 0) {
+            int sent = proxy_send_request(reader.fd, r, u, body);
+            if (sent == -2) {
+                close(reader.fd);
+                __atomic_sub_fetch(&Shared->health[index].active, 1, __ATOMIC_RELAXED);
+                return HTTP_STATUS_BAD_REQUEST;
+            }
+            if (sent == 0) {
+                result = proxy_relay_response(&reader, r, &code);
+            }
+        }
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT)) {
+            status = HTTP_STATUS_GATEWAY_TIMEOUT;
+        }
+        __atomic_sub_fetch(&Shared->health[index].active, 1, __ATOMIC_RELAXED);
+
+        if (result == 1) {
+            proxy_release(u, reader.fd);
+        } else if (reader.fd >= 0) {
+            close(reader.fd);
+        }
+
+        if (result == -2) {
+            proxy_failed(index);
+            shutdown(r->fd, SHUT_RDWR);
+            log("Upstream %s failed after response started; aborted %s %s", u->name, r->method, r->uri);
+            r->upstream = code;
+            return HTTP_STATUS_OK;
+        }
+
+        if (result >= 0) {
+            proxy_succeeded(index);
+            log("Proxied %s %s to %s: %d", r->method, r->uri, u->name, code);
+            r->upstream = code;
+            return HTTP_STATUS_OK;
+        }
+
+        /* A stale pooled connection is not the upstream's fault */
+        if (!reused) {
+            proxy_failed(index);
+            tried |= 1U << index;
+        }
+        if (body > 0) {
+            break;
+        }
+    }
+
+    log("Unable to proxy %s %s: %s", r->method, r->uri, http_status_string(status));
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,232 @@
+/* ratelimit.c: Per-Client Rate Limiting */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/* Each client (and rule) has a token bucket kept as a single theoretical
+ * arrival time (GCRA): a request is admitted if it would not push that time
+ * more than the burst allowance ahead of now.  A bucket is thus one 64-bit
+ * word updated with compare-and-swap, and the buckets live in an open
+ * addressed hash table in shared memory, so limits hold across workers
+ * without locks.  A bucket that has been full (idle) for RATELIMIT_IDLE may
+ * be taken over by a new client, which ages out stale entries without a
+ * sweeper.  If no bucket can be found the request is admitted. */
+
+#define RATELIMIT_SLOTS     8192        /* Buckets in shared table */
+#define RATELIMIT_PROBES    16          /* Slots examined per lookup */
+#define RATELIMIT_RULES     8           /* Maximum number of rules */
+#define RATELIMIT_IDLE      60000000000ULL  /* Nanoseconds before a full bucket is reclaimed */
+
+typedef struct {
+    char       *prefix;                 /*< URI prefix (NULL for whole client) */
+    size_t      length;                 /*< Length of prefix */
+    uint64_t    interval;               /*< Nanoseconds per token */
+    uint64_t    burst;                  /*< Burst allowance (nanoseconds) */
+} RateRule;
+
+typedef struct {
+    uint64_t    key;                    /*< Hash of client and rule (0 = empty) */
+    uint64_t    tat;                    /*< Theoretical arrival time (trace_now) */
+} RateBucket;
+
+static RateRule    Rules[RATELIMIT_RULES];
+static size_t      NRules  = 0;
+static RateBucket *Buckets = NULL;
+
+/**
+ * Parse rate limit rules and allocate buckets shared by all workers.
+ *
+ * @param   specs       Comma separated rules: [prefix=]rate[:burst], where
+ *                      rate is requests per second and burst defaults to
+ *                      rate (at least 1).  A rule without a prefix limits
+ *                      each client as a whole.
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked.
+ **/
+int ratelimit_init(const char *specs) {
+    char *copy = strdup(specs);
+    char *save = NULL;
+
+    if (!copy) {
+        return -1;
+    }
+
+    for (char *spec = strtok_r(copy, ",", &save); spec; spec = strtok_r(NULL, ",", &save)) {
+        char  *equal = strchr(spec, '=');
+        char  *end;
+        double rate, burst;
+
+        if (NRules == RATELIMIT_RULES) {
+            fprintf(stderr, "Too many rate limits (maximum %d)\n", RATELIMIT_RULES);
+            goto fail;
+        }
+
+        RateRule *rule = &Rules[NRules];
+        rule->prefix = NULL;
+        rule->length = 0;
+        if (equal) {
+            *equal = '\0';
+            rule->prefix = strdup(spec);
+            rule->length = strlen(spec);
+            spec = equal + 1;
+        }
+
+        rate  = strtod(spec, &end);
+        burst = *end == ':' ? strtod(end + 1, &end) : (rate < 1 ? 1 : (uint64_t)(rate + 0.999));
+        if (*end != '\0' || rate <= 0 || burst < 1 || (equal && rule->length == 0)) {
+            fprintf(stderr, "Invalid rate limit: %s\n", spec);
+            goto fail;
+        }
+
+        rule->interval = 1e9 / rate;
+        rule->burst    = burst * rule->interval;
+        NRules++;
+    }
+
+    void *map = mmap(NULL, RATELIMIT_SLOTS * sizeof(RateBucket), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to mmap rate limits: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    Buckets = map;
+    free(copy);
+    return 0;
+
+fail:
+    free(copy);
+    return -1;
+}
+
+/**
+ * Hash client address and rule into a bucket key (FNV-1a).
+ **/
+static uint64_t ratelimit_key(const ClientAddress *peer, size_t rule) {
+    uint64_t hash = (0xcbf29ce484222325ULL ^ rule ^ peer->family) * 0x100000001b3ULL;
+
+    for (size_t i = 0; i < sizeof(peer->addr); i++) {
+        hash = (hash ^ peer->addr[i]) * 0x100000001b3ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Find or claim bucket for key.
+ *
+ * @return  Bucket or NULL if the neighbourhood is full of active clients.
+ **/
+static RateBucket * ratelimit_bucket(uint64_t key, uint64_t now) {
+    RateBucket *stale = NULL;
+    uint64_t    old   = 0;
+
+    for (size_t probe = 0; probe < RATELIMIT_PROBES; probe++) {
+        RateBucket *b = &Buckets[(key + probe) % RATELIMIT_SLOTS];
+        uint64_t    k = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+
+        if (k == 0) {
+            if (__atomic_compare_exchange_n(&b->key, &k, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || k == key) {
+                return b;
+            }
+        }
+        if (k == key) {
+            return b;
+        }
+        if (!stale && __atomic_load_n(&b->tat, __ATOMIC_RELAXED) + RATELIMIT_IDLE < now) {
+            stale = b;
+            old   = k;
+        }
+    }
+
+    /* Take over a bucket that has been full for a while; its arrival time is
+     * in the past, so it starts out full for the new client too */
+    if (stale && __atomic_compare_exchange_n(&stale->key, &old, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return stale;
+    }
+    return NULL;
+}
+
+/**
+ * Take a token from bucket.
+ *
+ * @return  0 if admitted, otherwise nanoseconds until a token is available.
+ **/
+static uint64_t ratelimit_take(RateBucket *b, const RateRule *rule, uint64_t now) {
+    uint64_t tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        next = (tat > now ? tat : now) + rule->interval;
+        if (next - now > rule->burst) {
+            return next - now - rule->burst;
+        }
+    } while (!__atomic_compare_exchange_n(&b->tat, &tat, next, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return 0;
+}
+
+/**
+ * Check whether request is within its rate limits.
+ *
+ * @param   r           Request structure (client address).
+ * @param   uri         Request URI, or NULL to apply only the whole-client
+ *                      rules (before the request is read).
+ * @return  0 if admitted, otherwise nanoseconds until the client may retry.
+ *
+ * With a URI, only the rule with the longest matching prefix applies.
+ **/
+uint64_t ratelimit_check(const Request *r, const char *uri) {
+    const RateRule *match = NULL;
+    size_t          index = 0;
+
+    if (!Buckets) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < NRules; i++) {
+        const RateRule *rule = &Rules[i];
+        if (uri ? rule->prefix && strncmp(uri, rule->prefix, rule->length) == 0 && (!match || rule->length > match->length)
+                : !rule->prefix && !match) {
+            match = rule;
+            index = i;
+        }
+    }
+    if (!match) {
+        return 0;
+    }
+
+    uint64_t    now = trace_now();
+    RateBucket *b   = ratelimit_bucket(ratelimit_key(&r->peer, index), now);
+    if (!b) {
+        char host[REQUEST_HOST_MAX];
+        debug("Rate limit table full; admitting %s", request_host(r, host, sizeof(host)));
+        return 0;
+    }
+    return ratelimit_take(b, match, now);
+}
+
+/**
+ * Reject request with a fast 429 Too Many Requests.
+ *
+ * @param   r           Request structure.
+ * @param   wait        Nanoseconds until the client may retry.
+ *
+ * Like admission_reject, the response is sent without blocking so that
+ * turning a client away never stalls the accepting process.
+ **/
+void ratelimit_reject(Request *r, uint64_t wait) {
+    char retry[32];
+    char host[REQUEST_HOST_MAX];
+
+    snprintf(retry, sizeof(retry), "%llu", (unsigned long long)(wait + 999999999) / 1000000000);
+    response_reject(r->fd, HTTP_STATUS_TOO_MANY_REQUESTS, retry);
+
+    log("Rate limited %s: retry in %.3fs", request_host(r, host, sizeof(host)), wait / 1e9);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+
+import http.client
+import json
+import multiprocessing
+import os
+import sys
+import time
+
+# Globals
+
+PROCESSES = 1
+SCALE     = 1.0
+MAXIMUM   = False
+REUSE     = 1
+CAPTURE   = None
+TARGET    = None
+
+# Headers that describe the original connection rather than the request
+HOP_HEADERS = {'connection', 'keep-alive', 'upgrade', 'http2-settings', 'te',
+               'transfer-encoding', 'content-length', 'host'}
+
+# Functions
+
+def usage(status=0):
+    print('''Usage: {} [-p PROCESSES -s SCALE -m -k REUSE] CAPTURE HOST:PORT
+    -h              Display help message
+
+    -p  PROCESSES   Number of processes to utilize (1)
+    -s  SCALE       Replay SCALE times faster than recorded (1.0)
+    -m              Replay at maximum rate (ignore timestamps)
+    -k  REUSE       Requests per connection, if the server keeps it open (1)
+
+Replays a capture written by spidey -w and reports latency per URI class.
+    '''.format(os.path.basename(sys.argv[0])))
+    sys.exit(status)
+
+def load_capture(path):
+    ''' Return list of captured requests, ordered by arrival. '''
+    requests = []
+    with open(path, errors='replace') as stream:
+        for line in stream:
+            line = line.strip()
+            if line:
+                requests.append(json.loads(line))
+    requests.sort(key=lambda r: r['ts'])
+    return requests
+
+def uri_class(uri):
+    ''' Group URIs by directory and extension (/scripts/*.sh). '''
+    directory, _, name = uri.rpartition('/')
+    extension = os.path.splitext(name)[1]
+    if not name:
+        return directory + '/'
+    return '{}/*{}'.format(directory, extension) if extension else directory + '/*'
+
+def percentile(samples, fraction):
+    return samples[min(len(samples) - 1, int(len(samples) * fraction))]
+
+def do_replay(pid):
+    ''' Replay every PROCESSES-th request and return (class, latency, ok) samples. '''
+    requests = load_capture(CAPTURE)
+    host, _, port = TARGET.rpartition(':')
+    origin = requests[0]['ts'] if requests else 0
+    start = START
+    samples = []
+    connection = None
+    used = 0
+
+    time.sleep(max(0, start - time.time()))
+    for request in requests[pid::PROCESSES]:
+        if not MAXIMUM:
+            delay = start + (request['ts'] - origin) / SCALE - time.time()
+            if delay > 0:
+                time.sleep(delay)
+
+        if connection is None or used >= REUSE:
+            if connection:
+                connection.close()
+            connection = http.client.HTTPConnection(host, int(port), timeout=30)
+            used = 0
+
+        uri = request['uri'] + ('?' + request['query'] if request.get('query') else '')
+        headers = {k: v for k, v in request['headers'].items() if k.lower() not in HOP_HEADERS}
+        begin = time.time()
+        try:
+            connection.request(request['method'], uri, headers=headers)
+            response = connection.getresponse()
+            response.read()
+            ok = response.status < 500
+            used += 1
+            if response.will_close:
+                connection.close()
+                connection = None
+        except (OSError, http.client.HTTPException):
+            ok = False
+            connection.close()
+            connection = None
+        samples.append((uri_class(request['uri']), time.time() - begin, ok))
+
+    if connection:
+        connection.close()
+    return samples
+
+def report(samples, elapsed):
+    classes = {}
+    for name, latency, ok in samples:
+        classes.setdefault(name, []).append((latency, ok))
+    classes['TOTAL'] = [(latency, ok) for _, latency, ok in samples]
+
+    print('{:<24} {:>8} {:>6} {:>9} {:>9} {:>9} {:>9}'.format('CLASS', 'COUNT', 'ERRORS', 'P50 ms', 'P90 ms', 'P99 ms', 'MAX ms'))
+    for name in sorted(classes, key=lambda n: (n == 'TOTAL', n)):
+        latencies = sorted(latency * 1000 for latency, _ in classes[name])
+        errors = sum(1 for _, ok in classes[name] if not ok)
+        print('{:<24} {:>8} {:>6} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f}'.format(
+            name, len(latencies), errors, percentile(latencies, 0.50),
+            percentile(latencies, 0.90), percentile(latencies, 0.99), latencies[-1]))
+    print('{} requests in {:.3f} seconds ({:.1f} requests/second)'.format(len(samples), elapsed, len(samples) / elapsed if elapsed else 0))
+
+# Main execution
+
+if __name__ == '__main__':
+    # Parse command line arguments
+    args = sys.argv[1:]
+    while len(args) and args[0].startswith('-') and len(args[0])>1:
+        arg = args.pop(0)
+        if arg == '-h':
+            usage(0)
+        elif arg == '-p':
+            PROCESSES = int(args.pop(0))
+        elif arg == '-s':
+            SCALE = float(args.pop(0))
+        elif arg == '-m':
+            MAXIMUM = True
+        elif arg == '-k':
+            REUSE = int(args.pop(0))
+        else:
+            usage(1)
+    if len(args) != 2 or PROCESSES < 1 or SCALE <= 0 or REUSE < 1:
+        usage(1)
+    CAPTURE, TARGET = args
+
+    # Create pool of workers sharing one start time and replay the capture
+    START = time.time() + 0.1
+    pool = multiprocessing.Pool(PROCESSES)
+    samples = [s for result in pool.map(do_replay, range(PROCESSES)) for s in result]
+
+    if not samples:
+        print('No requests in {}'.format(CAPTURE))
+        sys.exit(1)
+    report(samples, time.time() - START)
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -1,61 +1,424 @@
 /* request.c: HTTP Request Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+/* Requests are the per-connection state, so they are kept small: the client
+ * address is stored numerically, and instead of a stdio stream (a FILE plus
+ * its own buffer) each request reads through a buffer that starts at
+ * REQUEST_BUFFER_MIN on the first read and only grows for long lines.  The
+ * fields every read touches come first, in the request's first cache line.
+ *
+ * Freed requests go on a per-process free list, keeping their minimum size
+ * buffer, so a busy server recycles the same few objects instead of
+ * returning to malloc for each connection.
+ *
+ * The deadline of each request's current phase is a timer on the process's
+ * deadline wheel, so changing phase or freeing the request cancels it in
+ * O(1).  Waits on a request go through request_poll, which sleeps no longer
+ * than the wheel's next tick and then advances it; an expired deadline just
+ * marks its request, and the wait returns.  The wheel needs no setup: an
+ * empty wheel jumps straight to the current time when advanced. */
+
+#define REQUEST_FREE_MAX    64          /* Requests kept on the free list */
+
+static Request *FreeList = NULL;
+static size_t   Recycled = 0;           /* Requests on the free list */
+static size_t   Live     = 0;           /* Requests in use */
+static size_t   Buffered = 0;           /* Bytes of read buffers (live and recycled) */
+
+static TimerWheel Deadlines;            /* Phase deadlines of this process's requests */
+
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
 
+/**
+ * Mark request whose phase deadline passed (timer callback).
+ **/
+static void request_expire(Timer *timer) {
+    Request *r = timer->data;
+    debug("Request deadline exceeded in phase %d", r->phase);
+    r->expired = true;
+}
+
+/**
+ * Wait for events on file descriptors, at most until the request's deadline.
+ *
+ * @param   r           Request structure.
+ * @param   pfds        File descriptors to poll.
+ * @param   nfds        Number of file descriptors.
+ * @param   timeout     Milliseconds to wait at most (-1 = until the deadline).
+ * @return  Number of ready descriptors, 0 if the timeout elapsed or the
+ *          deadline of the current phase passed (r->expired), or -1 on error.
+ **/
+int request_poll(Request *r, struct pollfd *pfds, nfds_t nfds, int timeout) {
+    uint64_t until = timeout >= 0 ? timer_now() + timeout : 0;
+
+    while (!r->expired) {
+        int wait = timer_wheel_timeout(&Deadlines);
+        if (timeout >= 0) {
+            int64_t left = (int64_t)(until - timer_now());
+            wait = left <= 0 ? 0 : (wait < 0 || left < wait ? left : wait);
+        }
+
+        int ready = poll(pfds, nfds, wait);
+        timer_wheel_advance(&Deadlines, timer_now());
+        if (ready > 0 || (ready < 0 && errno != EINTR)) {
+            return ready;
+        }
+        if (timeout >= 0 && timer_now() >= until) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read from client socket, honoring the request's current deadline.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to read into.
+ * @param   size        Size of buffer.
+ * @param   wait        Whether to wait for data that has not arrived yet.
+ * @return  Number of bytes read, 0 on EOF, or -1 on error (ETIMEDOUT if the
+ * deadline passed, EAGAIN if nothing has arrived and wait is false).
+ *
+ * Data that is already available costs a single recv; otherwise we poll for
+ * the time left until the deadline, so a client trickling bytes cannot
+ * extend it.  The first bytes of a request move it from the idle to the
+ * header phase.
+ **/
+static ssize_t request_recv(Request *r, char *buffer, size_t size, bool wait) {
+    ssize_t  nread;
+
+    while (true) {
+        nread = recv(r->fd, buffer, size, MSG_DONTWAIT);
+        if (nread >= 0) {
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (!wait) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+        if (request_poll(r, &pfd, 1, -1) < 0) {
+            return -1;
+        }
+        if (r->expired) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    if (nread > 0 && r->phase == PHASE_IDLE) {
+        request_mark(r, MARK_FIRST_BYTE);
+        request_set_phase(r, PHASE_HEADER);
+    }
+    return nread;
+}
+
+/**
+ * Read more from client socket into the request's buffer.
+ *
+ * @param   r           Request structure.
+ * @param   wait        Whether to wait for data (see request_recv).
+ * @return  Number of bytes read, 0 on EOF, or -1 on error (E2BIG if the
+ * buffer is full of unparsed bytes at its largest size).
+ *
+ * Unparsed bytes are moved to the front first; the buffer is allocated (or
+ * doubled) only when that leaves no room.
+ **/
+static ssize_t request_fill(Request *r, bool wait) {
+    if (r->start > 0) {
+        memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+        r->end  -= r->start;
+        r->start = 0;
+    }
+
+    if (r->end == r->capacity) {
+        uint32_t capacity = r->capacity ? 2 * r->capacity : REQUEST_BUFFER_MIN;
+        if (capacity > REQUEST_BUFFER_MAX) {
+            errno = E2BIG;
+            return -1;
+        }
+
+        char *buffer = realloc(r->buffer, capacity);
+        if (!buffer) {
+            return -1;
+        }
+        Buffered   += capacity - r->capacity;
+        r->buffer   = buffer;
+        r->capacity = capacity;
+    }
+
+    ssize_t nread = request_recv(r, r->buffer + r->end, r->capacity - r->end, wait);
+    if (nread > 0) {
+        r->end += nread;
+    }
+    return nread;
+}
+
+/**
+ * Read line from client.
+ *
+ * @param   r           Request structure.
+ * @param   length      Set to the length of the line (including '\n').
+ * @param   wait        Whether to wait for the rest of the line; if false,
+ *                      an incomplete line is left buffered and NULL is
+ *                      returned with errno set to EAGAIN.
+ * @return  Line in the request's buffer, or NULL on EOF (errno is 0) or error.
+ *
+ * The line is not NUL-terminated, but always ends with '\n', and stays valid
+ * until the next read from the request.
+ **/
+char * request_line(Request *r, size_t *length, bool wait) {
+    size_t scanned = 0;
+
+    while (true) {
+        char *line    = r->buffer + r->start;
+        char *newline = r->buffer ? memchr(line + scanned, '\n', request_buffered(r) - scanned) : NULL;
+        if (newline) {
+            *length   = newline - line + 1;
+            r->start += *length;
+            return line;
+        }
+
+        scanned = request_buffered(r);
+        ssize_t nread = request_fill(r, wait);
+        if (nread <= 0) {
+            if (nread == 0) {
+                errno = 0;
+            }
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Read exactly length bytes from client (fewer only on EOF or error).
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to read into.
+ * @param   length      Number of bytes to read.
+ * @return  Number of bytes read.
+ *
+ * Buffered bytes are copied out first; reads of at least REQUEST_BUFFER_MIN
+ * go straight from the socket into the caller's buffer.
+ **/
+size_t request_read(Request *r, void *buffer, size_t length) {
+    char  *data  = buffer;
+    size_t total = 0;
+
+    while (total < length) {
+        size_t buffered = request_buffered(r);
+        if (buffered > 0) {
+            size_t n = buffered < length - total ? buffered : length - total;
+            memcpy(data + total, r->buffer + r->start, n);
+            r->start += n;
+            total    += n;
+            continue;
+        }
+
+        if (length - total >= REQUEST_BUFFER_MIN) {
+            ssize_t nread = request_recv(r, data + total, length - total, true);
+            if (nread <= 0) {
+                break;
+            }
+            total += nread;
+        } else if (request_fill(r, true) <= 0) {
+            break;
+        }
+    }
+    return total;
+}
+
+/**
+ * Format client address.
+ *
+ * @param   r           Request structure.
+ * @param   host        Buffer for address (REQUEST_HOST_MAX bytes).
+ * @param   size        Size of buffer.
+ * @return  host, holding the numeric address ("unix" for Unix domain peers).
+ **/
+const char * request_host(const Request *r, char *host, size_t size) {
+    if (r->peer.family == AF_UNIX) {
+        snprintf(host, size, "unix");
+    } else if (!inet_ntop(r->peer.family, r->peer.addr, host, size)) {
+        snprintf(host, size, "-");
+    }
+    return host;
+}
+
+/**
+ * Enter request phase and (re)arm its deadline on the wheel.
+ *
+ * @param   r           Request structure.
+ * @param   phase       New phase (the current one to restart its deadline).
+ *
+ * A phase whose timeout is not positive has no deadline.
+ **/
+void request_set_phase(Request *r, RequestPhase phase) {
+    static const int *Timeouts[] = {
+        [PHASE_IDLE]   = &IdleTimeout,
+        [PHASE_HEADER] = &HeaderTimeout,
+        [PHASE_BODY]   = &BodyTimeout,
+        [PHASE_WRITE]  = &WriteTimeout,
+    };
+
+    uint64_t now = timer_now();
+
+    timer_wheel_advance(&Deadlines, now);
+    r->phase   = phase;
+    r->expired = false;
+    if (*Timeouts[phase] > 0) {
+        timer_add(&Deadlines, &r->timer, now + *Timeouts[phase]);
+    } else {
+        timer_cancel(&Deadlines, &r->timer);
+    }
+}
+
+/**
+ * Populate client information for a Unix domain socket peer.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Unix peers have no address, so the port is the peer's process id; the
+ * peer credentials are logged.
+ **/
+static int request_peer_unix(Request *r) {
+    struct ucred cred;
+    socklen_t    length = sizeof(cred);
+
+    if (getsockopt(r->fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) < 0) {
+        fprintf(stderr, "Unable to getsockopt SO_PEERCRED: %s\n", strerror(errno));
+        return -1;
+    }
+
+    r->peer.port = cred.pid;
+    log("Accepted request from unix:%s (pid %d, uid %d, gid %d)", r->listener->address, cred.pid, cred.uid, cred.gid);
+    return 0;
+}
+
+/**
+ * Allocate request (from the free list if possible).
+ *
+ * @return  Request initialized to 0 (without a socket), or NULL on error.
+ *
+ * The returned request struct must be deallocated using free_request.
+ **/
+Request * request_alloc(void) {
+    Request *r        = FreeList;
+    char    *buffer   = NULL;
+    uint32_t capacity = 0;
+
+    if (r) {
+        FreeList = r->next;
+        Recycled--;
+        buffer   = r->buffer;
+        capacity = r->capacity;
+    } else if ((errno = posix_memalign((void **)&r, REQUEST_ALIGN, sizeof(Request))) != 0) {
+        fprintf(stderr, "Unable to posix_memalign: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memset(r, 0, sizeof(Request));
+    r->fd             = -1;
+    r->buffer         = buffer;
+    r->capacity       = capacity;
+    r->timer.callback = request_expire;
+    r->timer.data     = r;
+    Live++;
+    return r;
+}
+
 /**
  * Accept request from server socket.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listener    Listener with a pending connection.
  * @return  Newly allocated Request structure.
  *
  * This function does the following:
  *
  *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  2. Accepts a client connection from the server socket.
+ *  3. Stores the client address in the request struct.
+ *  4. Returns the request struct.
+ *
+ * The client socket is accepted non-blocking and close-on-exec (so it never
+ * leaks into CGI scripts), and the client address is kept numeric to avoid
+ * a reverse DNS lookup on the accept path.  Nothing is read until the
+ * request is parsed, so an idle connection has no read buffer.
  *
  * The returned request struct must be deallocated using free_request.
  **/
-Request * accept_request(int sfd) {
-    Request *r = calloc(1, sizeof(Request));
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
+Request * accept_request(const Listener *listener) {
+    Request *r = request_alloc();
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
+    char host[REQUEST_HOST_MAX];
+
+    if (!r) {
+        return NULL;
+    }
+    r->listener = listener;
 
-    /* Allocate request struct (zeroed) */
-   
     /* Accept a client */
-    r->fd = accept(sfd, &raddr, &rlen);
+    r->fd = accept4(listener->fd, (struct sockaddr *)&raddr, &rlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (r->fd < 0) {
-        fprintf(stderr, "Unable to accept: %s\n", strerror(errno));
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            fprintf(stderr, "Unable to accept: %s\n", strerror(errno));
+        }
         goto fail;
     }
-
-    /* Lookup client information */
-    int client_info = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), 0);
-    if (client_info != 0) {
-        fprintf(stderr, "Unable to lookup: %s\n", gai_strerror(client_info));
+    request_mark(r, MARK_ACCEPT);
+    r->written = response_write_time();
+    PROBE(request__accept, r->fd, listener->fd);
+
+    /* Record client address */
+    r->peer.family = raddr.ss_family;
+    if (raddr.ss_family == AF_UNIX) {
+        if (request_peer_unix(r) < 0) {
+            goto fail;
+        }
+    } else if (raddr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&raddr;
+        memcpy(r->peer.addr, &in->sin_addr, sizeof(in->sin_addr));
+        r->peer.port = ntohs(in->sin_port);
+    } else if (raddr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&raddr;
+        memcpy(r->peer.addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        r->peer.port = ntohs(in6->sin6_port);
+    } else {
+        fprintf(stderr, "Unable to lookup: unknown address family %d\n", raddr.ss_family);
         goto fail;
     }
-
-    /* Open socket stream */
-    r->file = fdopen(r->fd, "r+");
-    if (!r->file) {
-        fprintf(stderr, "Unable to fdopen: %s\n", strerror(errno));
-        goto fail;
+    if (raddr.ss_family != AF_UNIX) {
+        log("Accepted request from %s:%u", request_host(r, host, sizeof(host)), r->peer.port);
     }
+    request_mark(r, MARK_CLIENT);
 
-    log("Accepted request from %s:%s", r->host, r->port);
+    /* Responses are written directly to the fd by the response writer */
+    response_configure_socket(r->fd);
+    request_set_phase(r, PHASE_IDLE);
     return r;
 
 fail:
@@ -71,19 +434,19 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Closes the request socket or file descriptor.
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ *  4. Returns request struct to the free list (or frees it if full).
  **/
 void free_request(Request *r) {
     if (!r) {
     	return;
     }
 
-    /* Close socket or fd */
-    if (!r->fd) ;
-    else fclose(r->file);
+    /* Cancel deadline and close socket or fd */
+    timer_cancel(&Deadlines, &r->timer);
+    if (r->fd >= 0) close(r->fd);
 
     /* Free allocated strings */
     if (!r->method) ;
@@ -99,17 +462,57 @@ void free_request(Request *r) {
     else free(r->query);
 
     /* Free headers */
+    for (HeaderId id = 0; id < HEADER_KNOWN; id++) {
+        free(r->known[id]);
+    }
+
     if (!r->headers) ;
     else {
         while (r->headers != NULL) {
             Header *temp = r->headers;
             r->headers = r->headers->next;
+            free(temp->name);
+            free(temp->value);
             free(temp);
         }
     }
 
+    /* Recycle request, keeping a minimum size buffer */
+    Live--;
+    if (r->capacity > REQUEST_BUFFER_MIN) {
+        Buffered   -= r->capacity;
+        free(r->buffer);
+        r->buffer   = NULL;
+        r->capacity = 0;
+    }
+    if (Recycled < REQUEST_FREE_MAX) {
+        r->next  = FreeList;
+        FreeList = r;
+        Recycled++;
+        return;
+    }
+
     /* Free request */
-    free(r); 
+    Buffered -= r->capacity;
+    free(r->buffer);
+    free(r);
+}
+
+/**
+ * Write per-connection memory report (for this process).
+ *
+ * @param   w           Response writer.
+ * @return  -1 on error and 0 on success.
+ **/
+int request_report(Response *w) {
+    size_t objects = Live + Recycled;
+
+    response_printf(w, "request_object_bytes %zu\n", sizeof(Request));
+    response_printf(w, "request_buffer_bytes %d-%d\n", REQUEST_BUFFER_MIN, REQUEST_BUFFER_MAX);
+    response_printf(w, "requests_live %zu\n", Live);
+    response_printf(w, "requests_recycled %zu\n", Recycled);
+    response_printf(w, "request_memory_bytes %zu\n", objects * sizeof(Request) + Buffered);
+    return response_printf(w, "request_mean_bytes %zu\n", objects ? (objects * sizeof(Request) + Buffered) / objects : 0);
 }
 
 /**
@@ -132,6 +535,8 @@ int parse_request(Request *r) {
         return -1;
     }
 
+    request_mark(r, MARK_PARSED);
+    PROBE(request__parsed, r->fd, r->method, r->uri);
     return 0;
 }
 
@@ -150,47 +555,55 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (if it exists), and version
+ * (HTTP/1.0 unless the client says HTTP/1.1).  Each
+ * field is delimited and validated in one pass by scan_span; a request line
+ * with invalid characters is rejected.
  **/
 int parse_request_method(Request *r) {
-    char buffer[BUFSIZ];
-    char *method=NULL;
-    char *uri=NULL;
-    char *query=NULL;
+    char  *buffer;
+    size_t length;
+    size_t method;
+    size_t uri;
+    size_t query = 0;
 
     /* Read line from socket */
-    if (fgets(buffer, BUFSIZ, r->file) == NULL) {
+    if ((buffer = request_line(r, &length, true)) == NULL) {
         goto fail;
     }
 
-    /* Parse method and uri */
-    if((method = strtok(buffer, " ")) == NULL) {
-	debug("Could not parse method");
-	return -1;
+    /* Parse method: a token terminated by a space */
+    method = scan_span(buffer, length, SCAN_TOKEN);
+    if (method == 0 || buffer[method] != ' ') {
+        debug("Could not parse method");
+        return -1;
     }
-    if((uri = strtok(NULL, " ")) == NULL) {
-	debug("Could not parse uri");
+
+    /* Parse uri up to the query, then the query up to the version */
+    char *start = buffer + method + 1;
+    uri = scan_span(start, length - method - 1, SCAN_URI);
+    if (uri == 0) {
+        debug("Could not parse uri");
+        return -1;
     }
-   
 
-    /* Parse query from uri */
-    if(uri != NULL) {
-	//query = uri;
-	query= strtok(uri, "?");
-	if(query!=NULL){
-            debug("query my check: %s", query);
-            query = strtok(NULL," \n\r");
-	   // *(query - 1) = '\0';
-        }
+    char *end = start + uri;
+    if (*end == '?') {
+        query = scan_span(end + 1, length - (end + 1 - buffer), SCAN_QUERY);
+        end  += query + 1;
+    }
+    if (*end != ' ' && *end != '\r' && *end != '\n') {
+        debug("Invalid character in uri");
+        return -1;
     }
 
-    /* Record method, uri, and query in request struct */
-    if(method)
-    	r->method= strdup(method);
-    if(uri)
-	r->uri= strdup(uri);
-    if(query)
-	r->query= strdup(query);
+    /* Record method, uri, query, and version in request struct */
+    r->version = strncmp(end, " HTTP/1.1", 9) == 0 ? 11 : 10;
+    r->method = strndup(buffer, method);
+    r->uri    = strndup(start, uri);
+    if (query) {
+        r->query = strndup(start + uri + 1, query);
+    }
 
     debug("HTTP METHOD: %s", r->method);
     debug("HTTP URI:    %s", r->uri);
@@ -228,37 +641,59 @@ fail:
  *      name, value = buffer.split(':')
  *      header      = new Header(name, value)
  *      headers.append(header)
+ *
+ * Names must be tokens and values field content (checked by scan_span while
+ * splitting); anything else fails the request.
  **/
 int parse_request_headers(Request *r) {
-    struct header *curr = NULL;
-    char buffer[BUFSIZ];
-    char *name;
-    char *value;
+    char  *buffer;
+    size_t length;
+    size_t name;
+    size_t value;
+
+    /* Parse headers from socket */
+    while ((buffer = request_line(r, &length, true)) != NULL) {
+        if (buffer[0] == '\r' || buffer[0] == '\n') {
+            break;
+        }
 
-    /* Parse headers from socket */                    /*NEED TO FINISH READING STREAM*/
-    if (fgets(buffer, BUFSIZ, r->file) == NULL) {
-        goto fail;
-    } else {
-        chomp(buffer);
-        name = skip_whitespace(buffer);
-        value = strchr(name, ':');
-        if (value == NULL) {
+        /* Name is a token immediately followed by ':' */
+        name = scan_span(buffer, length, SCAN_TOKEN);
+        if (name == 0 || buffer[name] != ':') {
             goto fail;
         }
-        *value = '\0';
-        value++;
-        value = skip_whitespace(value);
-        
-        curr = calloc(1, sizeof(struct header)); 
+        buffer[name] = '\0';
 
-        curr->name = strdup(name);
-        curr->value = strdup(value);
-        curr->next = r->headers;
+        /* Value runs to the line ending, without surrounding whitespace */
+        char *start = buffer + name + 1;
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        value = scan_span(start, length - (start - buffer), SCAN_VALUE);
+        if (start[value] != '\r' && start[value] != '\n') {
+            goto fail;
+        }
+        while (value > 0 && (start[value - 1] == ' ' || start[value - 1] == '\t')) {
+            value--;
+        }
 
-        r->headers = curr;
+        if (request_add_header(r, buffer, name, start, value) < 0) {
+            goto fail;
+        }
+    }
+
+    /* Read error or deadline exceeded before the blank line (EOF ends the
+     * headers) */
+    if (!buffer && errno != 0) {
+        goto fail;
     }
 
 #ifndef NDEBUG
+    for (HeaderId id = 0; id < HEADER_KNOWN; id++) {
+        if (r->known[id]) {
+            debug("HTTP HEADER %s = %s", header_name(id), r->known[id]);
+        }
+    }
     for (struct header *header = r->headers; header != NULL; header = header->next) {
     	debug("HTTP HEADER %s = %s", header->name, header->value);
     }
@@ -269,4 +704,63 @@ fail:
     return -1;
 }
 
+/**
+ * Add HTTP Request Header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Header name.
+ * @param   nlength     Length of name.
+ * @param   value       Header value.
+ * @param   vlength     Length of value.
+ * @return  -1 on error and 0 on success.
+ *
+ * Well-known headers are interned into r->known; repeated ones are combined
+ * into one comma separated value (semicolon for Cookie).  Other headers are
+ * kept on the r->headers side list.
+ **/
+int request_add_header(Request *r, const char *name, size_t nlength, const char *value, size_t vlength) {
+    HeaderId id = header_lookup(name, nlength);
+
+    if (id < HEADER_KNOWN) {
+        char *old = r->known[id];
+        if (!old) {
+            return (r->known[id] = strndup(value, vlength)) ? 0 : -1;
+        }
+
+        size_t length   = strlen(old);
+        char  *combined = realloc(old, length + 2 + vlength + 1);
+        if (!combined) {
+            return -1;
+        }
+        combined[length]     = id == HEADER_COOKIE ? ';' : ',';
+        combined[length + 1] = ' ';
+        memcpy(combined + length + 2, value, vlength);
+        combined[length + 2 + vlength] = '\0';
+        r->known[id] = combined;
+        return 0;
+    }
+
+    Header *header = calloc(1, sizeof(Header));
+    if (!header) {
+        return -1;
+    }
+
+    header->name  = strndup(name, nlength);
+    header->value = strndup(value, vlength);
+    header->next  = r->headers;
+    r->headers    = header;
+    return header->name && header->value ? 0 : -1;
+}
+
+/**
+ * Lookup HTTP Request Header.
+ *
+ * @param   r           Request structure.
+ * @param   id          Well-known header identifier.
+ * @return  Header value or NULL if not present.
+ **/
+const char * request_header(Request *r, HeaderId id) {
+    return id < HEADER_KNOWN ? r->known[id] : NULL;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
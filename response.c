@@ -0,0 +1,521 @@
+/* response.c: HTTP Response Writer */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <poll.h>
+
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Pre-rendered Response Fragments */
+
+#define STATUS_LINE(s)  { "HTTP/1.0 " s "\r\n", sizeof("HTTP/1.0 " s "\r\n") - 1 }
+
+typedef struct {
+    const char *data;                   /*< Pre-rendered bytes */
+    size_t      length;                 /*< Number of bytes (excluding NUL) */
+} Fragment;
+
+static const Fragment StatusLines[] = {
+    STATUS_LINE("200 OK"),
+    STATUS_LINE("400 Bad Request"),
+    STATUS_LINE("404 Not Found"),
+    STATUS_LINE("500 Internal Server Error"),
+    STATUS_LINE("304 Not Modified"),
+    STATUS_LINE("503 Service Unavailable"),
+    STATUS_LINE("408 Request Timeout"),
+    STATUS_LINE("429 Too Many Requests"),
+    STATUS_LINE("502 Bad Gateway"),
+    STATUS_LINE("504 Gateway Timeout"),
+    STATUS_LINE("413 Payload Too Large"),
+};
+
+/* Every response ends its connection, even one delimited by Content-Length
+ * or chunked encoding: requests are served one per connection (and one per
+ * process in forking mode), so there is no loop to read a next request. */
+static const Fragment CommonHeaders = {
+    "Server: spidey\r\n"
+    "Connection: close\r\n",
+    sizeof("Server: spidey\r\n" "Connection: close\r\n") - 1,
+};
+
+static const Fragment HeaderEnd = { "\r\n", 2 };
+
+static const Fragment ChunkedHeader = {
+    "Transfer-Encoding: chunked\r\n",
+    sizeof("Transfer-Encoding: chunked\r\n") - 1,
+};
+
+static const Fragment LastChunk = { "0\r\n\r\n", 5 };
+
+static uint64_t WriteTime = 0;          /* Nanoseconds spent flushing (this process) */
+
+/**
+ * Set TCP option on socket, ignoring failures on non-TCP sockets.
+ *
+ * @param   fd          Socket file descriptor.
+ * @param   option      TCP level option (TCP_NODELAY, TCP_CORK).
+ * @param   value       Option value.
+ **/
+static void response_setsockopt(int fd, int option, int value) {
+    if (setsockopt(fd, IPPROTO_TCP, option, &value, sizeof(value)) < 0 && errno != EOPNOTSUPP && errno != ENOTSOCK) {
+        debug("Unable to setsockopt(%d): %s", option, strerror(errno));
+    }
+}
+
+/**
+ * Restart the write deadline of the writer's request (if it is writing).
+ *
+ * The deadline bounds a stall, not the response: it is renewed when a flush
+ * starts and whenever writev makes progress, so a client that keeps reading
+ * is never cut off, however long the response takes to produce or send.
+ **/
+static void response_extend(Response *w) {
+    if (w->request && w->request->phase == PHASE_WRITE) {
+        request_set_phase(w->request, PHASE_WRITE);
+    }
+}
+
+/**
+ * Return bytes queued on socket but not yet sent (-1 if unknown).
+ **/
+static int response_queued(int fd) {
+    int queued;
+    return ioctl(fd, SIOCOUTQ, &queued) < 0 ? -1 : queued;
+}
+
+/**
+ * Wait for non-blocking socket to become writable.
+ *
+ * @param   w           Response writer.
+ * @return  -1 on error or timeout and 0 on success.
+ *
+ * Waits until the deadline of the writer's request or, for writers without
+ * one, for at most WriteTimeout per stall.  TCP only reports a socket writable once a third
+ * of its (autotuned, possibly several MiB) send buffer is free, so a client
+ * reading steadily but slowly can outlast the timeout; as long as the send
+ * queue keeps shrinking, the peer is not stalled and the wait goes on (a
+ * deadline of any other phase is final).
+ **/
+static int response_wait(Response *w) {
+    int queued = response_queued(w->fd);
+
+    while (true) {
+        struct pollfd pfd   = { .fd = w->fd, .events = POLLOUT };
+        int           ready = w->request ? request_poll(w->request, &pfd, 1, -1) : poll(&pfd, 1, WriteTimeout > 0 ? WriteTimeout : -1);
+        if (ready != 0) {
+            return ready < 0 && errno != EINTR ? -1 : 0;
+        }
+
+        int now = response_queued(w->fd);
+        if (now < 0 || now >= queued || (w->request && w->request->phase != PHASE_WRITE)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        queued = now;
+        response_extend(w);
+    }
+}
+
+/**
+ * Append a slice to the pending iovec, flushing first if it is full.
+ *
+ * @param   w           Response writer.
+ * @param   data        Start of slice.
+ * @param   length      Length of slice.
+ * @return  -1 on error and 0 on success.
+ **/
+static int response_push(Response *w, const void *data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    /* Coalesce with previous slice if contiguous (common for scratch) */
+    if (w->iovcnt > 0) {
+        struct iovec *last = &w->iov[w->iovcnt - 1];
+        if ((const char *)last->iov_base + last->iov_len == (const char *)data) {
+            last->iov_len += length;
+            w->pending    += length;
+            return 0;
+        }
+    }
+
+    if (w->iovcnt == RESPONSE_IOV_MAX && response_flush(w, true) < 0) {
+        return -1;
+    }
+
+    w->iov[w->iovcnt].iov_base = (void *)data;
+    w->iov[w->iovcnt].iov_len  = length;
+    w->iovcnt++;
+    w->pending += length;
+    return 0;
+}
+
+/**
+ * Initialize response writer for the specified socket.
+ *
+ * @param   w           Response writer.
+ * @param   fd          Client socket file descriptor.
+ * @param   request     Request whose phase deadline bounds write stalls
+ *                      (NULL to wait at most WriteTimeout per stall); its
+ *                      write deadline is renewed by every flush that makes
+ *                      progress.
+ *
+ * Nothing is written to the socket until response_flush is called.
+ **/
+void response_init(Response *w, int fd, Request *request) {
+    w->fd      = fd;
+    w->request = request;
+    w->iovcnt  = 0;
+    w->pending = 0;
+    w->used    = 0;
+    w->sent    = 0;
+    w->corked  = false;
+    w->chunked = false;
+}
+
+/**
+ * Queue pre-rendered status line and common headers.
+ *
+ * @param   w           Response writer.
+ * @param   status      HTTP Status.
+ * @return  -1 on error and 0 on success.
+ **/
+int response_status(Response *w, HTTPStatus status) {
+    if (status < 0 || status >= sizeof(StatusLines) / sizeof(StatusLines[0])) {
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    if (response_push(w, StatusLines[status].data, StatusLines[status].length) < 0) {
+        return -1;
+    }
+    return response_push(w, CommonHeaders.data, CommonHeaders.length);
+}
+
+/**
+ * Queue arbitrary status line (e.g. relayed from an upstream) and common
+ * headers.
+ *
+ * @param   w           Response writer.
+ * @param   code        Three digit status code.
+ * @param   reason      Reason phrase.
+ * @return  -1 on error and 0 on success.
+ *
+ * If w->chunked is set, the response is HTTP/1.1 and announces chunked
+ * transfer encoding; its body must then be queued with response_chunk.
+ **/
+int response_status_code(Response *w, int code, const char *reason) {
+    if (response_printf(w, "HTTP/1.%d %03d %s\r\n", w->chunked ? 1 : 0, code, reason) < 0) {
+        return -1;
+    }
+    if (response_push(w, CommonHeaders.data, CommonHeaders.length) < 0) {
+        return -1;
+    }
+    return w->chunked ? response_push(w, ChunkedHeader.data, ChunkedHeader.length) : 0;
+}
+
+/**
+ * Send canned error response without blocking.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   status      HTTP status code.
+ * @param   retry       Retry-After value in seconds.
+ * @return  -1 on error and 0 on success.
+ *
+ * The whole response is handed to the kernel with a single non-blocking
+ * send, so the accepting process never waits on a slow client; if it does
+ * not fit in the socket buffer it is dropped.  Whatever the client already
+ * sent is then discarded so closing the socket does not reset the
+ * connection before the response is read.
+ **/
+int response_reject(int fd, HTTPStatus status, const char *retry) {
+    char buffer[BUFSIZ];
+
+    if (status < 0 || status >= sizeof(StatusLines) / sizeof(StatusLines[0])) {
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    int length = snprintf(buffer, sizeof(buffer),
+                          "%s%sRetry-After: %s\r\nContent-Type: text/html\r\n\r\n"
+                          "<html><body> \"HTTP Status: %s\" </body></html>\r\n",
+                          StatusLines[status].data, CommonHeaders.data, retry, http_status_string(status));
+    if (length < 0 || (size_t)length >= sizeof(buffer)) {
+        return -1;
+    }
+
+    ssize_t nwritten = send(fd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (nwritten != length) {
+        debug("Unable to send %s: %s", http_status_string(status), nwritten < 0 ? strerror(errno) : "short write");
+    }
+
+    if (shutdown(fd, SHUT_WR) == 0) {
+        while (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+    }
+    return nwritten == length ? 0 : -1;
+}
+
+/**
+ * Queue formatted header line.
+ *
+ * @param   w           Response writer.
+ * @param   name        Header name.
+ * @param   value       Header value.
+ * @return  -1 on error and 0 on success.
+ **/
+int response_header(Response *w, const char *name, const char *value) {
+    return response_printf(w, "%s: %s\r\n", name, value);
+}
+
+/**
+ * Queue Content-Length header.
+ *
+ * @param   w           Response writer.
+ * @param   length      Length of response body.
+ * @return  -1 on error and 0 on success.
+ **/
+int response_content_length(Response *w, size_t length) {
+    return response_printf(w, "Content-Length: %zu\r\n", length);
+}
+
+/**
+ * Queue blank line terminating the response headers.
+ *
+ * @param   w           Response writer.
+ * @return  -1 on error and 0 on success.
+ **/
+int response_end_headers(Response *w) {
+    return response_push(w, HeaderEnd.data, HeaderEnd.length);
+}
+
+/**
+ * Queue slice by reference.
+ *
+ * @param   w           Response writer.
+ * @param   data        Start of slice.
+ * @param   length      Length of slice.
+ * @return  -1 on error and 0 on success.
+ *
+ * The data is not copied and must remain valid until the next
+ * response_flush.
+ **/
+int response_append(Response *w, const void *data, size_t length) {
+    return response_push(w, data, length);
+}
+
+/**
+ * Queue slice of body by reference, as one chunk if the response is chunked.
+ *
+ * @param   w           Response writer.
+ * @param   data        Start of slice.
+ * @param   length      Length of slice (0 queues nothing).
+ * @return  -1 on error and 0 on success.
+ *
+ * As with response_append, the data must remain valid until the next
+ * response_flush.
+ **/
+int response_chunk(Response *w, const void *data, size_t length) {
+    if (!w->chunked) {
+        return response_push(w, data, length);
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    if (response_printf(w, "%zx\r\n", length) < 0 || response_push(w, data, length) < 0) {
+        return -1;
+    }
+    return response_push(w, HeaderEnd.data, HeaderEnd.length);
+}
+
+/**
+ * Queue last chunk terminating a chunked body (nothing otherwise).
+ *
+ * @param   w           Response writer.
+ * @return  -1 on error and 0 on success.
+ **/
+int response_end_chunks(Response *w) {
+    return w->chunked ? response_push(w, LastChunk.data, LastChunk.length) : 0;
+}
+
+/**
+ * Queue slice by copying it into the writer's scratch buffer.
+ *
+ * @param   w           Response writer.
+ * @param   data        Start of slice.
+ * @param   length      Length of slice.
+ * @return  -1 on error and 0 on success.
+ *
+ * Used for short-lived data such as frame headers.  Slices larger than the
+ * scratch buffer are written through immediately.
+ **/
+int response_copy(Response *w, const void *data, size_t length) {
+    if (length > RESPONSE_SCRATCH) {
+        if (response_push(w, data, length) < 0) {
+            return -1;
+        }
+        return response_flush(w, true);
+    }
+
+    if ((w->iovcnt == RESPONSE_IOV_MAX || RESPONSE_SCRATCH - w->used < length) && response_flush(w, true) < 0) {
+        return -1;
+    }
+
+    char *start = w->scratch + w->used;
+    memcpy(start, data, length);
+    w->used += length;
+    return response_push(w, start, length);
+}
+
+/**
+ * Queue formatted string by copying it into the writer's scratch buffer.
+ *
+ * @param   w           Response writer.
+ * @param   fmt         printf(3) format string.
+ * @return  -1 on error and 0 on success.
+ *
+ * If the scratch buffer is full, pending data is flushed first.
+ **/
+int response_printf(Response *w, const char *fmt, ...) {
+    va_list args;
+    int     n;
+
+    /* Make sure the formatted slice can be queued without an implicit flush
+     * recycling the scratch buffer underneath it */
+    if (w->iovcnt == RESPONSE_IOV_MAX && response_flush(w, true) < 0) {
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t available = RESPONSE_SCRATCH - w->used;
+
+        va_start(args, fmt);
+        n = vsnprintf(w->scratch + w->used, available, fmt, args);
+        va_end(args);
+
+        if (n < 0 || n >= RESPONSE_SCRATCH) {
+            debug("Formatted response fragment too large");
+            return -1;
+        }
+
+        if ((size_t)n < available) {
+            char *start = w->scratch + w->used;
+            w->used += n;
+            return response_push(w, start, n);
+        }
+
+        /* Not enough room: flush pending slices and reuse scratch */
+        if (response_flush(w, true) < 0) {
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Write all pending slices to the socket with writev (see response_flush).
+ **/
+static int response_writev(Response *w, bool more) {
+    struct iovec *iov    = w->iov;
+    int           iovcnt = w->iovcnt;
+
+    if (more && !w->corked) {
+        response_setsockopt(w->fd, TCP_CORK, 1);
+        w->corked = true;
+    }
+
+    response_extend(w);
+    while (iovcnt > 0) {
+        ssize_t nwritten = writev(w->fd, iov, iovcnt);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && response_wait(w) == 0) {
+                continue;
+            }
+            debug("Unable to writev: %s", strerror(errno));
+            return -1;
+        }
+
+        /* Progress renews the stall deadline */
+        if (nwritten > 0) {
+            response_extend(w);
+        }
+
+        w->sent    += nwritten;
+        w->pending -= nwritten;
+
+        /* Skip fully written slices and adjust partially written one */
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base  = (char *)iov->iov_base + nwritten;
+            iov->iov_len  -= nwritten;
+        }
+    }
+
+    w->iovcnt = 0;
+    w->used   = 0;
+
+    if (!more && w->corked) {
+        response_setsockopt(w->fd, TCP_CORK, 0);
+        w->corked = false;
+    }
+    return 0;
+}
+
+/**
+ * Write all pending slices to the socket with writev.
+ *
+ * @param   w           Response writer.
+ * @param   more        Whether more data will follow for this response.
+ * @return  -1 on error and 0 on success.
+ *
+ * A response that fits in a single flush is sent with one writev and, since
+ * the socket has TCP_NODELAY set, leaves in one packet.  A response flushed
+ * in several pieces corks the socket until the final flush so partial frames
+ * are not sent.
+ **/
+int response_flush(Response *w, bool more) {
+    uint64_t start  = trace_now();
+    int      status = response_writev(w, more);
+
+    WriteTime += trace_now() - start;
+    return status;
+}
+
+/**
+ * Return nanoseconds this process has spent flushing responses (including
+ * waiting for a slow client to drain the socket).
+ **/
+uint64_t response_write_time(void) {
+    return WriteTime;
+}
+
+/**
+ * Configure TCP options for a freshly accepted client socket.
+ *
+ * @param   fd          Client socket file descriptor.
+ *
+ * Responses are batched by the writer, so Nagle's algorithm only adds
+ * latency; disable it.  Client sockets are non-blocking, so stalled writes
+ * are bounded by response_wait rather than a send timeout.
+ **/
+void response_configure_socket(int fd) {
+    response_setsockopt(fd, TCP_NODELAY, 1);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
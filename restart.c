@@ -0,0 +1,193 @@
+/* restart.c: Configuration Reload and Binary Upgrade */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Environment variables used to hand state to the upgraded binary */
+
+#define RESTART_LISTENERS   "SPIDEY_LISTENERS"
+#define RESTART_READY       "SPIDEY_READY"
+#define RESTART_TIMEOUT     10000       /* Milliseconds to wait for upgrade */
+
+static char **RestartArgv = NULL;
+static char  *RestartPath = NULL;
+static char  *RestartRoot = NULL;
+
+/**
+ * Record how this server was started.
+ *
+ * @param   argv        Command line arguments.
+ *
+ * This must be called before RootPath is resolved.  The binary is located
+ * now, so an upgrade executes whatever has since been installed at the same
+ * path rather than the running image.
+ **/
+void restart_init(char *argv[]) {
+    char path[PATH_MAX];
+
+    RestartArgv = argv;
+    RestartRoot = strdup(RootPath);
+    RestartPath = strchr(argv[0], '/') && realpath(argv[0], path) ? strdup(path) : argv[0];
+}
+
+/**
+ * Re-read configuration in place (SIGHUP).
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * RootPath is resolved again (so a symlink flipped by a deploy takes effect)
+ * and the site bundle is remapped and the route table recompiled.  The mime
+ * types file is read per request and needs no reload.  On error the previous configuration is kept.
+ **/
+int restart_reload(void) {
+    char *root = realpath(RestartRoot ? RestartRoot : RootPath, NULL);
+    if (!root) {
+        fprintf(stderr, "Unable to resolve RootPath: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (BundlePath && bundle_open(BundlePath) < 0) {
+        free(root);
+        return -1;
+    }
+
+    free(RootPath);
+    RootPath = root;
+    log("Reloaded configuration: RootPath = %s", RootPath);
+    return route_compile();
+}
+
+/**
+ * Start upgraded binary on the same listening sockets (SIGUSR2).
+ *
+ * @param   listeners   Listening sockets.
+ * @param   nlisteners  Number of listening sockets.
+ * @return  -1 on error and the pid of the new server if it is up and
+ *          accepting.
+ *
+ * The new server is a child of this one (until this one exits), so a
+ * forking server must not count it among its connection handlers.  The
+ * listening descriptors survive exec and are advertised to the new
+ * server in SPIDEY_LISTENERS, so connections queued in the backlog are
+ * never dropped.  The new server reports readiness over a pipe advertised
+ * in SPIDEY_READY; until then (or if it fails) this server keeps serving.
+ **/
+pid_t restart_upgrade(Listener *listeners, size_t nlisteners) {
+    int ready[2];
+
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        fprintf(stderr, "Unable to pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        char     fds[LISTENERS_MAX * 12] = "";
+        char     fd[16];
+        sigset_t mask;
+
+        for (size_t i = 0; i < nlisteners; i++) {
+            fcntl(listeners[i].fd, F_SETFD, 0);
+            snprintf(fd, sizeof(fd), "%s%d", i ? "," : "", listeners[i].fd);
+            strcat(fds, fd);
+        }
+        fcntl(ready[1], F_SETFD, 0);
+        snprintf(fd, sizeof(fd), "%d", ready[1]);
+
+        setenv(RESTART_LISTENERS, fds, 1);
+        setenv(RESTART_READY, fd, 1);
+
+        /* The signal mask survives exec */
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        execv(RestartPath, RestartArgv);
+        fprintf(stderr, "Unable to exec %s: %s\n", RestartPath, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    close(ready[1]);
+
+    struct pollfd pfd = { .fd = ready[0], .events = POLLIN };
+    char   byte;
+    int    status = -1;
+    if (poll(&pfd, 1, RESTART_TIMEOUT) > 0 && read(ready[0], &byte, 1) == 1) {
+        status = 0;
+    }
+    close(ready[0]);
+
+    if (status < 0) {
+        fprintf(stderr, "Upgraded server %d failed to start\n", pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    log("Upgraded server %d is accepting; draining", pid);
+    return pid;
+}
+
+/**
+ * Tell the server that started us (if any) that we are accepting.
+ **/
+void restart_ready(void) {
+    char *fd = getenv(RESTART_READY);
+    if (!fd) {
+        return;
+    }
+
+    int ready = atoi(fd);
+    if (write(ready, "1", 1) != 1) {
+        debug("Unable to signal readiness: %s", strerror(errno));
+    }
+    close(ready);
+    unsetenv(RESTART_READY);
+}
+
+/**
+ * Adopt listening sockets handed over by the previous server.
+ *
+ * @param   listeners   Array to store listeners in.
+ * @param   max         Capacity of listeners array.
+ * @return  Number of inherited listeners (0 if none).
+ **/
+size_t restart_inherit(Listener *listeners, size_t max) {
+    char *fds = getenv(RESTART_LISTENERS);
+    if (!fds) {
+        return 0;
+    }
+
+    char  *copy  = strdup(fds);
+    char  *save  = NULL;
+    size_t count = 0;
+
+    for (char *fd = copy ? strtok_r(copy, ",", &save) : NULL; fd && count < max; fd = strtok_r(NULL, ",", &save)) {
+        if (socket_adopt(atoi(fd), Backlog, &listeners[count]) == 0) {
+            count++;
+        }
+    }
+
+    free(copy);
+    unsetenv(RESTART_LISTENERS);
+    return count;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
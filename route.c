@@ -0,0 +1,367 @@
+/* route.c: Compiled Route Table */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* URI paths are looked up in a trie with one node per path segment.  At
+ * startup (and on reload) every file and directory under RootPath is
+ * classified once and stored with its real path and mimetype, so requests
+ * for existing content are dispatched without touching the filesystem.
+ * Configured prefixes attach options (forced handler, cache TTL,
+ * precompressed variants, body limit) to a node, and they apply to the
+ * whole subtree.  Paths that are not in the table, such as files added
+ * since the last compile, are resolved the old way by the caller. */
+
+#define ROUTE_PREFIXES      16          /* Maximum number of configured prefixes */
+#define ROUTE_ENTRIES       65536       /* Maximum number of indexed paths */
+#define ROUTE_DEPTH         32          /* Maximum indexed directory depth */
+
+typedef struct route_node RouteNode;
+struct route_node {
+    char               *segment;        /*< Path segment */
+    RouteNode         **children;       /*< Children (sorted by segment once compiled) */
+    size_t              nchildren;      /*< Number of children */
+    size_t              capacity;       /*< Capacity of children */
+    Route               route;          /*< Indexed path (kind ROUTE_UNKNOWN if none) */
+    const RouteOptions *options;        /*< Configured options (or NULL) */
+};
+
+static const RouteOptions DefaultOptions = { .kind = ROUTE_UNKNOWN, .ttl = -1 };
+
+static RouteOptions  Options[ROUTE_PREFIXES];
+static char         *Prefixes[ROUTE_PREFIXES];
+static size_t        NOptions = 0;
+static RouteNode    *Root     = NULL;
+static size_t        Entries  = 0;
+
+/* Trie */
+
+/**
+ * Find child of node with the specified segment (length bytes).
+ **/
+static RouteNode * route_child(RouteNode *node, const char *segment, size_t length) {
+    size_t low  = 0;
+    size_t high = node->nchildren;
+
+    while (low < high) {
+        size_t     mid   = (low + high) / 2;
+        RouteNode *child = node->children[mid];
+        int        cmp   = strncmp(child->segment, segment, length);
+
+        if (cmp == 0 && child->segment[length] != '\0') {
+            cmp = 1;
+        }
+        if (cmp == 0) {
+            return child;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find or insert child of node with the specified segment (keeping children
+ * sorted).
+ **/
+static RouteNode * route_insert(RouteNode *node, const char *segment, size_t length) {
+    RouteNode *child = route_child(node, segment, length);
+    if (child) {
+        return child;
+    }
+
+    if (node->nchildren == node->capacity) {
+        size_t      capacity = node->capacity ? 2 * node->capacity : 4;
+        RouteNode **children = realloc(node->children, capacity * sizeof(RouteNode *));
+        if (!children) {
+            return NULL;
+        }
+        node->children = children;
+        node->capacity = capacity;
+    }
+
+    if (!(child = calloc(1, sizeof(RouteNode))) || !(child->segment = strndup(segment, length))) {
+        free(child);
+        return NULL;
+    }
+
+    size_t i = node->nchildren;
+    while (i > 0 && strcmp(node->children[i - 1]->segment, child->segment) > 0) {
+        node->children[i] = node->children[i - 1];
+        i--;
+    }
+    node->children[i] = child;
+    node->nchildren++;
+    return child;
+}
+
+/**
+ * Find or insert node for URI path.
+ **/
+static RouteNode * route_path(RouteNode *node, const char *path) {
+    while (node && *path) {
+        size_t length = strcspn(path, "/");
+        if (length > 0) {
+            node = route_insert(node, path, length);
+        }
+        path += length + (path[length] == '/');
+    }
+    return node;
+}
+
+/**
+ * Deallocate trie.
+ **/
+static void route_free(RouteNode *node) {
+    if (!node) {
+        return;
+    }
+    for (size_t i = 0; i < node->nchildren; i++) {
+        route_free(node->children[i]);
+    }
+    free(node->children);
+    free(node->segment);
+    free((char *)node->route.path);
+    free((char *)node->route.mimetype);
+    free((char *)node->route.gzip);
+    free(node);
+}
+
+/* Configuration */
+
+/**
+ * Parse configured route prefixes.
+ *
+ * @param   specs       Comma separated prefixes: prefix=option[:option...],
+ *                      where options are cgi or static (force handler),
+ *                      ttl=seconds (Cache-Control max-age), gzip (serve
+ *                      precompressed path.gz siblings), and body=bytes
+ *                      (maximum request body).
+ * @return  -1 on error and 0 on success.
+ **/
+int route_init(const char *specs) {
+    char *copy = specs ? strdup(specs) : NULL;
+    char *save = NULL;
+
+    for (char *spec = copy ? strtok_r(copy, ",", &save) : NULL; spec; spec = strtok_r(NULL, ",", &save)) {
+        char *equal = strchr(spec, '=');
+        char *next  = NULL;
+
+        if (!equal || equal == spec || spec[0] != '/' || NOptions == ROUTE_PREFIXES) {
+            fprintf(stderr, "Invalid route: %s\n", spec);
+            goto fail;
+        }
+        *equal = '\0';
+
+        RouteOptions *options = &Options[NOptions];
+        *options = DefaultOptions;
+        for (char *option = strtok_r(equal + 1, ":", &next); option; option = strtok_r(NULL, ":", &next)) {
+            if (streq(option, "cgi")) {
+                options->kind = ROUTE_CGI;
+            } else if (streq(option, "static")) {
+                options->kind = ROUTE_FILE;
+            } else if (streq(option, "gzip")) {
+                options->gzip = true;
+            } else if (strncmp(option, "ttl=", 4) == 0) {
+                options->ttl = atoi(option + 4);
+            } else if (strncmp(option, "body=", 5) == 0) {
+                options->max_body = strtoul(option + 5, NULL, 10);
+            } else {
+                fprintf(stderr, "Invalid route option: %s\n", option);
+                goto fail;
+            }
+        }
+        Prefixes[NOptions++] = strdup(spec);
+    }
+
+    free(copy);
+    return 0;
+
+fail:
+    free(copy);
+    return -1;
+}
+
+/**
+ * Determine handler for file.
+ *
+ * @param   path        Real path of file.
+ * @param   mode        File mode (from stat).
+ * @param   options     Options of the enclosing route prefix.
+ * @return  Handler kind, or ROUTE_UNKNOWN if the file must not be served.
+ *
+ * Executable files are CGI scripts and other readable files are static,
+ * unless the prefix forces one or the other.
+ **/
+RouteKind route_classify(const char *path, mode_t mode, const RouteOptions *options) {
+    if (S_ISDIR(mode)) {
+        return ROUTE_BROWSE;
+    }
+    if (!S_ISREG(mode)) {
+        return ROUTE_UNKNOWN;
+    }
+
+    switch (options->kind) {
+        case ROUTE_CGI:
+            return access(path, X_OK) == 0 ? ROUTE_CGI : ROUTE_UNKNOWN;
+        case ROUTE_FILE:
+            return access(path, R_OK) == 0 ? ROUTE_FILE : ROUTE_UNKNOWN;
+        default:
+            if (access(path, X_OK) == 0) {
+                return ROUTE_CGI;
+            }
+            return access(path, R_OK) == 0 ? ROUTE_FILE : ROUTE_UNKNOWN;
+    }
+}
+
+/**
+ * Index directory (recursively).
+ *
+ * @param   node        Node for directory.
+ * @param   path        Real path of directory.
+ * @param   options     Options inherited from enclosing prefix.
+ * @param   depth       Depth of directory below RootPath.
+ **/
+static void route_scan(RouteNode *node, const char *path, const RouteOptions *options, int depth) {
+    char child[PATH_MAX];
+    char real[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL && Entries < ROUTE_ENTRIES) {
+        if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+            continue;
+        }
+
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child) ||
+            !realpath(child, real) || strncmp(real, RootPath, strlen(RootPath)) != 0 || stat(real, &st) < 0) {
+            continue;
+        }
+
+        /* Only descend into real subdirectories, so symlinks cannot loop */
+        bool descend = depth < ROUTE_DEPTH && streq(real, child);
+
+        RouteNode *c = route_insert(node, entry->d_name, strlen(entry->d_name));
+        if (!c) {
+            break;
+        }
+        const RouteOptions *o = c->options ? c->options : options;
+
+        c->route.kind    = route_classify(real, st.st_mode, o);
+        c->route.options = o;
+        if (c->route.kind == ROUTE_UNKNOWN) {
+            continue;
+        }
+        c->route.path = strdup(real);
+        Entries++;
+
+        if (c->route.kind == ROUTE_FILE) {
+            c->route.mimetype = determine_mimetype(real);
+            c->route.size     = st.st_size;
+            if (o->gzip && snprintf(child, sizeof(child), "%s.gz", real) < (int)sizeof(child) && access(child, R_OK) == 0) {
+                c->route.gzip = strdup(child);
+            }
+        }
+
+        if (c->route.kind == ROUTE_BROWSE && descend) {
+            route_scan(c, real, o, depth + 1);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Compile route table from configured prefixes and the content of RootPath.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Replaces any previously compiled table, so it may be called again to
+ * pick up changes to the content (e.g. on SIGHUP).
+ **/
+int route_compile(void) {
+    RouteNode *root = calloc(1, sizeof(RouteNode));
+    struct stat st;
+
+    if (!root) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < NOptions; i++) {
+        RouteNode *node = route_path(root, Prefixes[i]);
+        if (!node) {
+            route_free(root);
+            return -1;
+        }
+        node->options = &Options[i];
+    }
+
+    Entries = 0;
+    const RouteOptions *options = root->options ? root->options : &DefaultOptions;
+    if (stat(RootPath, &st) == 0) {
+        root->route.kind    = route_classify(RootPath, st.st_mode, options);
+        root->route.path    = strdup(RootPath);
+        root->route.options = options;
+        route_scan(root, RootPath, options, 0);
+    }
+
+    route_free(Root);
+    Root = root;
+    log("Compiled route table: %zu paths, %zu prefixes", Entries, NOptions);
+    return 0;
+}
+
+/**
+ * Look up URI in compiled route table.
+ *
+ * @param   uri         Request URI (without query).
+ * @param   options     Set to the options of the longest configured prefix
+ *                      of uri (defaults if none).
+ * @return  Indexed route or NULL if the path is not in the table.
+ **/
+const Route * route_lookup(const char *uri, const RouteOptions **options) {
+    RouteNode *node = Root;
+
+    *options = &DefaultOptions;
+    if (!node) {
+        return NULL;
+    }
+    if (node->options) {
+        *options = node->options;
+    }
+
+    while (*uri) {
+        size_t length = strcspn(uri, "/");
+        if (length > 0) {
+            /* Leave dot segments to realpath */
+            if (uri[0] == '.' && (length == 1 || (length == 2 && uri[1] == '.'))) {
+                return NULL;
+            }
+            if (!(node = route_child(node, uri, length))) {
+                return NULL;
+            }
+            if (node->options) {
+                *options = node->options;
+            }
+        }
+        uri += length + (uri[length] == '/');
+    }
+
+    return node->route.kind != ROUTE_UNKNOWN ? &node->route : NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
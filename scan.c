@@ -0,0 +1,154 @@
+/* scan.c: Vectorized Request Scanning */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#include <immintrin.h>
+
+/* Every byte is classified by looking up its low nibble in a per-class
+ * table and its high nibble in a shared table and testing whether the two
+ * entries share a bit (the PSHUFB nibble technique), so 16 or 32 bytes are
+ * classified with two shuffles.  Bit h of a low nibble entry stands for high
+ * nibble h; no class contains 0x10-0x1F, so bit 1 is reused for every byte
+ * above 0x7F. */
+
+static uint8_t ScanTable[256];                  /* Bit c set if byte is in class c */
+static uint8_t ScanLow[SCAN_CLASSES][16] __attribute__((aligned(16)));
+static uint8_t ScanHigh[16] __attribute__((aligned(16)));
+
+/**
+ * Determine whether byte is in character class (reference definition).
+ **/
+static bool scan_member(int c, ScanClass class) {
+    switch (class) {
+        case SCAN_TOKEN:
+            /* RFC 7230 tchar */
+            return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+                   (c && strchr("!#$%&'*+-.^_`|~", c));
+        case SCAN_URI:
+            return c > ' ' && c < 0x7f && c != '?';
+        case SCAN_QUERY:
+            return c > ' ' && c < 0x7f;
+        case SCAN_VALUE:
+            /* Field content: visible characters, space, tab and obs-text */
+            return c == '\t' || (c >= ' ' && c != 0x7f);
+        default:
+            return false;
+    }
+}
+
+static uint8_t scan_high_bit(int nibble) {
+    return nibble >= 8 ? 0x02 : (nibble == 1 ? 0 : 1 << nibble);
+}
+
+/**
+ * Length of prefix of s whose bytes all belong to class (one at a time).
+ **/
+static size_t scan_span_scalar(const char *s, size_t n, ScanClass class) {
+    const uint8_t *p   = (const uint8_t *)s;
+    uint8_t        bit = 1 << class;
+    size_t         i   = 0;
+
+    while (i < n && (ScanTable[p[i]] & bit)) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Length of prefix of s whose bytes all belong to class (16 at a time).
+ **/
+__attribute__((target("sse4.2")))
+static size_t scan_span_sse42(const char *s, size_t n, ScanClass class) {
+    const __m128i low  = _mm_load_si128((const __m128i *)ScanLow[class]);
+    const __m128i high = _mm_load_si128((const __m128i *)ScanHigh);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i  x   = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i  l   = _mm_shuffle_epi8(low, _mm_and_si128(x, mask));
+        __m128i  h   = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(x, 4), mask));
+        unsigned out = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(l, h), _mm_setzero_si128()));
+        if (out) {
+            return i + __builtin_ctz(out);
+        }
+    }
+    return i + scan_span_scalar(s + i, n - i, class);
+}
+
+/**
+ * Length of prefix of s whose bytes all belong to class (32 at a time).
+ **/
+__attribute__((target("avx2")))
+static size_t scan_span_avx2(const char *s, size_t n, ScanClass class) {
+    const __m256i low  = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)ScanLow[class]));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)ScanHigh));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i  x   = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i  l   = _mm256_shuffle_epi8(low, _mm256_and_si256(x, mask));
+        __m256i  h   = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+        unsigned out = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(l, h), _mm256_setzero_si256()));
+        if (out) {
+            return i + __builtin_ctz(out);
+        }
+    }
+    return i + scan_span_sse42(s + i, n - i, class);
+}
+
+static size_t (*ScanSpan)(const char *, size_t, ScanClass) = scan_span_scalar;
+
+/**
+ * Build classification tables and select scanner for this CPU.
+ *
+ * @return  Name of selected implementation.
+ **/
+const char * scan_init(void) {
+    memset(ScanLow, 0, sizeof(ScanLow));
+    for (int h = 0; h < 16; h++) {
+        ScanHigh[h] = scan_high_bit(h);
+    }
+
+    for (int c = 0; c < 256; c++) {
+        ScanTable[c] = 0;
+        for (int class = 0; class < SCAN_CLASSES; class++) {
+            if (scan_member(c, class)) {
+                ScanTable[c]               |= 1 << class;
+                ScanLow[class][c & 0x0f]   |= scan_high_bit(c >> 4);
+            }
+        }
+    }
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ScanSpan = scan_span_avx2;
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        ScanSpan = scan_span_sse42;
+        return "sse4.2";
+    }
+    ScanSpan = scan_span_scalar;
+    return "scalar";
+}
+
+/**
+ * Compute length of the prefix of s consisting only of class bytes.
+ *
+ * @param   s           Start of buffer.
+ * @param   n           Length of buffer.
+ * @param   class       Character class.
+ * @return  Offset of the first byte outside class (n if none).
+ *
+ * The stop byte tells the caller both where the field ends (space, ':',
+ * '?', CR or LF) and whether it is well formed.
+ **/
+size_t scan_span(const char *s, size_t n, ScanClass class) {
+    return ScanSpan(s, n, class);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,31 +3,110 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <string.h>
 
+#include <sys/signalfd.h>
 #include <unistd.h>
 
 /**
  * Handle one HTTP request at a time.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listeners   Listening sockets.
+ * @param   nlisteners  Number of listening sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * SIGHUP reloads the configuration between requests.  SIGUSR2 hands the
+ * listening sockets to an upgraded binary and exits once it is accepting
+ * (there is never a request in flight at that point).
  **/
-int single_server(int sfd) {
+int single_server(Listener *listeners, size_t nlisteners) {
+    struct pollfd pfds[LISTENERS_MAX + 1];
+    sigset_t mask;
+
+    /* Route restart signals to a signalfd polled after the listeners */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        fprintf(stderr, "Unable to sigprocmask: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0) {
+        fprintf(stderr, "Unable to signalfd: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < nlisteners; i++) {
+        pfds[i].fd     = listeners[i].fd;
+        pfds[i].events = POLLIN;
+    }
+    pfds[nlisteners].fd     = sigfd;
+    pfds[nlisteners].events = POLLIN;
+
     /* Accept and handle HTTP request */
     while (true) {
-        /* Accept request */
-        Request *r = accept_request(sfd);
-        /* Handle request */
-        debug("going into handle_request");
-        HTTPStatus status = handle_request(r);
-        debug("Request Status: %s", http_status_string(status));
-        /* Free request */
-        free_request(r);
+        if (poll(pfds, nlisteners + 1, -1) < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Unable to poll: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        /* Handle restart signals */
+        if (pfds[nlisteners].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            bool upgraded = false;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGHUP) {
+                    restart_reload();
+                } else if (info.ssi_signo == SIGUSR2 && !upgraded) {
+                    upgraded = restart_upgrade(listeners, nlisteners) > 0;
+                }
+            }
+            if (upgraded) {
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < nlisteners; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            /* Accept request */
+            Request *r = accept_request(&listeners[i]);
+            if (!r) {
+                continue;
+            }
+
+            /* Turn away clients over their rate limit */
+            uint64_t wait = ratelimit_check(r, NULL);
+            if (wait) {
+                ratelimit_reject(r, wait);
+                free_request(r);
+                continue;
+            }
+
+            /* Handle request */
+            debug("going into handle_request");
+            admission_active(1);
+            HTTPStatus status = handle_request(r);
+            admission_active(0);
+            debug("Request Status: %s", http_status_string(status));
+            /* Free request */
+            free_request(r);
+        }
     }
 
-    /* Close server socket */
-    close(sfd);
+    /* Close server sockets */
+    close(sigfd);
+    for (size_t i = 0; i < nlisteners; i++) {
+        close(listeners[i].fd);
+    }
     return EXIT_SUCCESS;
 }
 
@@ -3,69 +3,423 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /**
- * Allocate socket, bind it, and listen to specified port.
+ * Set socket option, logging (but otherwise ignoring) failures.
  *
- * @param   port        Port number to bind to and listen on.
- * @return  Allocated server socket file descriptor.
+ * @return  -1 on error and 0 on success.
  **/
-int socket_listen(const char *port) {
-    /* Lookup server address information */
+static int socket_option(int fd, int level, int option, int value, const char *name) {
+    if (setsockopt(fd, level, option, &value, sizeof(value)) < 0) {
+        debug("Unable to set %s: %s", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Get integer socket option.
+ *
+ * @return  Value of option or 0 on error.
+ **/
+static int socket_get_option(int fd, int level, int option) {
+    int       value  = 0;
+    socklen_t length = sizeof(value);
+
+    if (getsockopt(fd, level, option, &value, &length) < 0) {
+        return 0;
+    }
+    return value;
+}
 
-    struct addrinfo  hints = {
-        .ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
-        .ai_socktype = SOCK_STREAM, /* Use TCP */
-        .ai_flags    = AI_PASSIVE,  /* Use all interfaces */
-    };
-    struct addrinfo *results;
-    int status;
-    if ((status = getaddrinfo(NULL, port, &hints, &results)) != 0) {
-        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
+/**
+ * Copy string into fixed size buffer.
+ *
+ * @return  -1 if it does not fit and 0 on success.
+ **/
+static int socket_copy(char *dst, size_t size, const char *src) {
+    size_t length = strlen(src);
+    if (length >= size) {
         return -1;
     }
+    memcpy(dst, src, length + 1);
+    return 0;
+}
 
+/**
+ * Split listener specification into host, port and backlog.
+ *
+ * @param   spec        Listener specification: [host:]port[/backlog], where
+ *                      IPv6 hosts are written in brackets ([::1]:9898).
+ * @param   host        Host buffer (empty for all interfaces).
+ * @param   port        Port buffer.
+ * @param   backlog     Backlog (left unchanged if not specified).
+ * @return  -1 on error and 0 on success.
+ **/
+static int socket_parse_spec(const char *spec, char *host, char *port, int *backlog) {
+    char  buffer[NI_MAXHOST + NI_MAXSERV + 16];
+    char *colon;
 
-    /* For each server entry, allocate socket and try to connect */
-    int socket_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
+    if (strlen(spec) >= sizeof(buffer)) {
+        return -1;
+    }
+    strcpy(buffer, spec);
 
-        /* Allocate socket */
-        if ((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
-            fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
-            continue;
+    char *slash = strchr(buffer, '/');
+    if (slash) {
+        *slash++ = '\0';
+        if ((*backlog = atoi(slash)) <= 0) {
+            return -1;
         }
+    }
 
-        /* Bind socket */
-        if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
-            fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
-            close(socket_fd);
-            socket_fd = -1;
-            continue;
+    host[0] = '\0';
+    if (buffer[0] == '[') {
+        char *close = strchr(buffer, ']');
+        if (!close || close[1] != ':') {
+            return -1;
+        }
+        *close = '\0';
+        if (socket_copy(host, NI_MAXHOST, buffer + 1) < 0 || socket_copy(port, NI_MAXSERV, close + 2) < 0) {
+            return -1;
+        }
+    } else if ((colon = strrchr(buffer, ':')) != NULL) {
+        *colon = '\0';
+        if (socket_copy(host, NI_MAXHOST, buffer) < 0 || socket_copy(port, NI_MAXSERV, colon + 1) < 0) {
+            return -1;
+        }
+    } else if (socket_copy(port, NI_MAXSERV, buffer) < 0) {
+        return -1;
+    }
+
+    return port[0] ? 0 : -1;
+}
+
+/**
+ * Return whether token of a listener specification list is a listener
+ * option (which applies to the specification before it).
+ **/
+static bool socket_is_option(const char *token) {
+    return strchr(token, '=') != NULL || streq(token, "noreuse");
+}
+
+/**
+ * Parse listener option.
+ *
+ * @param   option      Listener option: defer=seconds, fastopen=queue or
+ *                      noreuse.
+ * @param   l           Listener options to update.
+ * @return  -1 on error and 0 on success.
+ **/
+static int socket_parse_option(const char *option, Listener *l) {
+    const char *equals = strchr(option, '=');
+    char       *end;
+
+    if (streq(option, "noreuse")) {
+        l->reuse = false;
+        return 0;
+    }
+    if (!equals) {
+        return -1;
+    }
+
+    errno = 0;
+    long value = strtol(equals + 1, &end, 10);
+    if (errno || end == equals + 1 || *end != '\0' || value < 0 || value > INT_MAX) {
+        return -1;
+    }
+
+    if (equals - option == 5 && strncmp(option, "defer", 5) == 0) {
+        l->defer = value;
+    } else if (equals - option == 8 && strncmp(option, "fastopen", 8) == 0) {
+        l->fastopen = value;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Allocate socket for address, configure it, bind it, and listen.
+ *
+ * @param   p           Address to bind.
+ * @param   options     Listener backlog and socket options.
+ * @return  Listening socket file descriptor or -1 on error.
+ **/
+static int socket_bind(struct addrinfo *p, const Listener *options) {
+    int fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Restart without waiting for TIME_WAIT; bind IPv6 separately from IPv4
+     * so the wildcard addresses of both families can be listened on */
+    if (options->reuse) {
+        socket_option(fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+    }
+    if (p->ai_family == AF_INET6) {
+        socket_option(fd, IPPROTO_IPV6, IPV6_V6ONLY, 1, "IPV6_V6ONLY");
+    }
+
+    if (bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
+        fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* Only wake for connections that have sent data (within the defer
+     * interval) and accept data in the SYN from returning clients */
+    if (options->defer) {
+        socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options->defer, "TCP_DEFER_ACCEPT");
+    }
+    if (options->fastopen) {
+        socket_option(fd, IPPROTO_TCP, TCP_FASTOPEN, options->fastopen, "TCP_FASTOPEN");
+    }
+
+    if (listen(fd, options->backlog) < 0) {
+        fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Allocate Unix domain socket, bind it to path, and listen.
+ *
+ * @param   path        Socket path.
+ * @param   backlog     Maximum length of pending connection queue.
+ * @return  Listening socket file descriptor or -1 on error.
+ *
+ * A stale socket left at path by a previous server is removed; any other
+ * kind of file is left alone and the bind fails.
+ **/
+static int socket_bind_unix(const char *path, int backlog) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat s;
+
+    if (socket_copy(addr.sun_path, sizeof(addr.sun_path), path) < 0) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (lstat(path, &s) == 0 && S_ISSOCK(s.st_mode)) {
+        unlink(path);
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, backlog) < 0) {
+        fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Allocate sockets, bind them, and listen on the specified addresses.
+ *
+ * @param   specs       Comma separated listener specifications (see
+ *                      socket_parse_spec), each followed by its options
+ *                      (see socket_parse_option), or unix:/path for a Unix
+ *                      domain socket (which uses the default backlog and
+ *                      takes no options).
+ * @param   backlog     Default maximum length of pending connection queue.
+ * @param   listeners   Array to store listeners in.
+ * @param   max         Capacity of listeners array.
+ * @return  Number of listeners or 0 on error.
+ *
+ * A specification without a host listens on every address getaddrinfo
+ * returns, so both IPv4 and IPv6 wildcard sockets are bound.  Every
+ * specification must yield at least one listener.  TCP listeners defer
+ * accepting for the idle timeout, size the fast open queue to the backlog
+ * and set SO_REUSEADDR unless their options say otherwise.
+ **/
+size_t socket_listen(const char *specs, int backlog, Listener *listeners, size_t max) {
+    char   *copy = strdup(specs);
+    char   *save = NULL;
+    size_t  count = 0;
+
+    if (!copy) {
+        return 0;
+    }
+
+    for (char *spec = strtok_r(copy, ",", &save), *next; spec; spec = next) {
+        char host[NI_MAXHOST];
+        char port[NI_MAXSERV];
+        size_t bound = 0;
+        size_t noptions = 0;
+        Listener options = {
+            .backlog  = backlog,
+            .defer    = (IdleTimeout + 999) / 1000,
+            .fastopen = -1,
+            .reuse    = true,
+        };
+
+        if (socket_is_option(spec)) {
+            fprintf(stderr, "Invalid listener: %s\n", spec);
+            goto fail;
+        }
+        while ((next = strtok_r(NULL, ",", &save)) && socket_is_option(next)) {
+            if (socket_parse_option(next, &options) < 0) {
+                fprintf(stderr, "Invalid listener option: %s\n", next);
+                goto fail;
+            }
+            noptions++;
         }
 
-        /* Listen to socket */
-        if (listen(socket_fd, SOMAXCONN) < 0) {
-            fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
-            close(socket_fd);
-            socket_fd = -1;
+        if (strncmp(spec, "unix:", 5) == 0) {
+            int fd;
+            if (noptions) {
+                fprintf(stderr, "Unix listener takes no options: %s\n", spec);
+                goto fail;
+            }
+            if (count == max || (fd = socket_bind_unix(spec + 5, backlog)) < 0) {
+                fprintf(stderr, "Unable to listen on %s\n", spec);
+                goto fail;
+            }
+
+            Listener *l = &listeners[count++];
+            l->fd       = fd;
+            l->family   = AF_UNIX;
+            l->backlog  = backlog;
+            l->defer    = 0;
+            l->fastopen = 0;
+            l->reuse    = false;
+            l->port[0]  = '\0';
+            socket_copy(l->address, sizeof(l->address), spec + 5);
             continue;
         }
 
+        if (socket_parse_spec(spec, host, port, &options.backlog) < 0) {
+            fprintf(stderr, "Invalid listener: %s\n", spec);
+            goto fail;
+        }
+        if (options.fastopen < 0) {
+            options.fastopen = options.backlog;
+        }
+
+        /* Lookup server address information */
+        struct addrinfo  hints = {
+            .ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
+            .ai_socktype = SOCK_STREAM, /* Use TCP */
+            .ai_flags    = AI_PASSIVE,  /* Use all interfaces */
+        };
+        struct addrinfo *results;
+        int status;
+        if ((status = getaddrinfo(host[0] ? host : NULL, port, &hints, &results)) != 0) {
+            fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
+            goto fail;
+        }
+
+        /* For each server entry, allocate socket and listen */
+        for (struct addrinfo *p = results; p != NULL; p = p->ai_next) {
+            if (count == max) {
+                fprintf(stderr, "Too many listeners (maximum %zu)\n", max);
+                break;
+            }
 
+            int fd = socket_bind(p, &options);
+            if (fd < 0) {
+                continue;
+            }
+
+            Listener *l = &listeners[count++];
+            l->fd       = fd;
+            l->family   = p->ai_family;
+            l->backlog  = options.backlog;
+            l->defer    = options.defer;
+            l->fastopen = options.fastopen;
+            l->reuse    = options.reuse;
+            socket_copy(l->port, sizeof(l->port), port);
+            if (getnameinfo(p->ai_addr, p->ai_addrlen, l->address, sizeof(l->address), NULL, 0, NI_NUMERICHOST) != 0) {
+                socket_copy(l->address, sizeof(l->address), host);
+            }
+            bound++;
+        }
+        freeaddrinfo(results);
+
+        if (bound == 0) {
+            fprintf(stderr, "Unable to listen on %s\n", spec);
+            goto fail;
+        }
     }
 
-    freeaddrinfo(results);
-    return socket_fd;
+    free(copy);
+    return count;
+
+fail:
+    while (count > 0) {
+        close(listeners[--count].fd);
+    }
+    free(copy);
+    return 0;
 }
 
-/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
+/**
+ * Adopt already listening socket (inherited across exec).
+ *
+ * @param   fd          Listening socket file descriptor.
+ * @param   backlog     Backlog to record (the kernel does not report it).
+ * @param   listener    Listener to fill in.
+ * @return  -1 on error and 0 on success.
+ **/
+int socket_adopt(int fd, int backlog, Listener *listener) {
+    struct sockaddr_storage addr;
+    socklen_t length    = sizeof(addr);
+    int       accepting = 0;
+    socklen_t size      = sizeof(accepting);
 
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &size) < 0 || !accepting ||
+        getsockname(fd, (struct sockaddr *)&addr, &length) < 0) {
+        fprintf(stderr, "Unable to adopt listener %d: %s\n", fd, accepting ? strerror(errno) : "not listening");
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    listener->fd       = fd;
+    listener->family   = addr.ss_family;
+    listener->backlog  = backlog;
+    listener->defer    = addr.ss_family == AF_UNIX ? 0 : socket_get_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT);
+    listener->fastopen = addr.ss_family == AF_UNIX ? 0 : socket_get_option(fd, IPPROTO_TCP, TCP_FASTOPEN);
+    listener->reuse    = socket_get_option(fd, SOL_SOCKET, SO_REUSEADDR) != 0;
+    listener->port[0]  = '\0';
+    if (addr.ss_family == AF_UNIX) {
+        socket_copy(listener->address, sizeof(listener->address), ((struct sockaddr_un *)&addr)->sun_path);
+    } else if (getnameinfo((struct sockaddr *)&addr, length, listener->address, sizeof(listener->address), listener->port, sizeof(listener->port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        fprintf(stderr, "Unable to lookup listener %d\n", fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
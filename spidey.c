@@ -4,8 +4,10 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <signal.h>
 #include <string.h>
 
+#include <sys/socket.h>
 #include <unistd.h>
 
 /* Global Variables */
@@ -13,6 +15,29 @@ char *Port            = "9898";
 char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath        = "www";
+char *BundlePath      = NULL;
+int   Backlog         = SOMAXCONN;
+size_t MaxConnections = 0;
+size_t MaxCGIProcesses = 0;
+int   CGICPULimit     = 0;
+int   CGIMemoryLimit  = 0;
+int   CGIFileLimit    = 0;
+int   CGIWallLimit    = 0;
+int   CGINice         = 0;
+char *RetryAfter      = "1";
+int   IdleTimeout     = 5000;
+int   HeaderTimeout   = 10000;
+int   BodyTimeout     = 30000;
+int   WriteTimeout    = 30000;
+int   ConnectTimeout  = 2000;
+int   UpstreamTimeout = 30000;
+size_t MaxStreams     = 100;
+char *StatsPath       = NULL;
+char *CapturePath     = NULL;
+char *RateLimits      = NULL;
+char *ProxyRoutes     = NULL;
+char *RouteSpecs      = NULL;
+size_t IOThreads      = 4;
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +46,30 @@ char *RootPath        = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hbBcCGIlLmMopPrRsSTUwx]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -b path       Serve static content from site bundle\n");
+    fprintf(stderr, "    -B path       Pack root directory into site bundle and exit\n");
     fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -C count      Maximum concurrent connections (0 = unlimited)\n");
+    fprintf(stderr, "    -G count      Maximum in-flight CGI processes (0 = unlimited)\n");
+    fprintf(stderr, "    -I count      File I/O threads for large files (0 = read inline)\n");
+    fprintf(stderr, "    -l backlog    Default listen backlog\n");
+    fprintf(stderr, "    -L limits     Rate limit per client ([prefix=]rate[:burst],... requests/s)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
-    fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -p listeners  Addresses to listen on ([host:]port[/backlog][,defer=N][,fastopen=N][,noreuse] or unix:path,...)\n");
+    fprintf(stderr, "    -o routes     Route options (prefix=cgi|static[:ttl=N][:gzip][:body=N],...)\n");
+    fprintf(stderr, "    -P routes     Proxy prefixes to upstreams (prefix=[lc:]host:port[+...] or unix:path,...)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -R seconds    Retry-After for shed requests\n");
+    fprintf(stderr, "    -s uri        Serve request statistics at uri\n");
+    fprintf(stderr, "    -S count      Maximum concurrent HTTP/2 streams (0 = disable h2c)\n");
+    fprintf(stderr, "    -T i:h:b:w    Idle, header and whole-body deadlines, write stall timeout (ms)\n");
+    fprintf(stderr, "    -U c:r        Upstream connect and read/write stall timeouts (ms, 0 = unlimited)\n");
+    fprintf(stderr, "    -w path       Capture parsed requests to path (JSON lines)\n");
+    fprintf(stderr, "    -x c:m:f:w:n  CGI CPU s, memory MiB, file MiB, wall clock s, nice (0 = unlimited)\n");
     exit(status);
 }
 
@@ -38,12 +79,13 @@ void usage(const char *progname, int status) {
  * @param   argc        Number of arguments.
  * @param   argv        Array of argument strings.
  * @param   mode        Pointer to ServerMode variable.
+ * @param   build       Pointer to bundle output path (set if packing).
  * @return  true if parsing was successful, false if there was an error.
  *
  * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
  * if specified.
  */
-bool parse_options(int argc, char *argv[], ServerMode *mode) {
+bool parse_options(int argc, char *argv[], ServerMode *mode, char **build) {
     int argind = 1;
     char *m;
     while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
@@ -52,6 +94,12 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             case 'h':
                 usage(argv[0], 0);
                 break;
+            case 'b':
+                BundlePath = argv[argind++];
+                break;
+            case 'B':
+                *build = argv[argind++];
+                break;
             case 'c':
                 m = argv[argind++];
                 if(streq(m, "Single")) *mode = 0;
@@ -61,18 +109,66 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
                     return false;
                 }
                 break;
+            case 'C':
+                MaxConnections = strtoul(argv[argind++], NULL, 10);
+                break;
+            case 'G':
+                MaxCGIProcesses = strtoul(argv[argind++], NULL, 10);
+                break;
+            case 'I':
+                IOThreads = strtoul(argv[argind++], NULL, 10);
+                break;
+            case 'l':
+                Backlog = atoi(argv[argind++]);
+                break;
+            case 'L':
+                RateLimits = argv[argind++];
+                break;
             case 'm':
                 MimeTypesPath = argv[argind++];
                 break;
             case 'M':
                 DefaultMimeType = argv[argind++];
                 break;
+            case 'o':
+                RouteSpecs = argv[argind++];
+                break;
             case 'p':
                 Port = argv[argind++];
                 break;
+            case 'P':
+                ProxyRoutes = argv[argind++];
+                break;
             case 'r':
                 RootPath = argv[argind++];
                 break;
+            case 'R':
+                RetryAfter = argv[argind++];
+                break;
+            case 's':
+                StatsPath = argv[argind++];
+                break;
+            case 'S':
+                MaxStreams = strtoul(argv[argind++], NULL, 10);
+                break;
+            case 'T':
+                if (sscanf(argv[argind++], "%d:%d:%d:%d", &IdleTimeout, &HeaderTimeout, &BodyTimeout, &WriteTimeout) != 4) {
+                    usage(argv[0], 1);
+                }
+                break;
+            case 'U':
+                if (sscanf(argv[argind++], "%d:%d", &ConnectTimeout, &UpstreamTimeout) != 2) {
+                    usage(argv[0], 1);
+                }
+                break;
+            case 'w':
+                CapturePath = argv[argind++];
+                break;
+            case 'x':
+                if (sscanf(argv[argind++], "%d:%d:%d:%d:%d", &CGICPULimit, &CGIMemoryLimit, &CGIFileLimit, &CGIWallLimit, &CGINice) != 5) {
+                    usage(argv[0], 1);
+                }
+                break;
             default:
                 usage(argv[0], 1);
                 break;
@@ -86,35 +182,117 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
  **/
 int main(int argc, char *argv[]) {
     ServerMode mode = SINGLE;
+    char *build = NULL;
 
     /* Parse command line options */
-    if(!parse_options(argc, argv, &mode)){
+    if(!parse_options(argc, argv, &mode, &build)){
         debug("Could not parse options");
     }
-    /* Listen to server socket */
-    int sfd = socket_listen(Port);
-    if(sfd < 0) {
+
+    /* Pack site bundle instead of serving */
+    if (build) {
+        return bundle_build(RootPath, build) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* Listen to server sockets (or adopt those of the server we replace) */
+    Listener listeners[LISTENERS_MAX];
+    size_t   nlisteners = restart_inherit(listeners, LISTENERS_MAX);
+    if (nlisteners == 0) {
+        nlisteners = socket_listen(Port, Backlog, listeners, LISTENERS_MAX);
+    }
+    if(nlisteners == 0) {
         debug("socket_listen fail...");
         return EXIT_FAILURE;
     }
     /* Determine real RootPath */
+    restart_init(argv);
     if( (RootPath = realpath(RootPath, NULL)) == NULL) {
         debug("RootPath could not be resolved: %s", strerror(errno));
         return EXIT_FAILURE;
     }
 
-    log("Listening on port %s", Port);
+    /* Build well-known header table */
+    if (header_init() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Compile route table before forking so all workers share it */
+    if (route_init(RouteSpecs) < 0 || route_compile() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* A CGI script that exits without reading its body must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Select request scanner for this CPU */
+    const char *scanner = scan_init();
+
+    /* Allocate admission counters shared with workers */
+    if (admission_init() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Allocate request statistics shared with workers */
+    if (stats_init() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Allocate rate limit buckets shared with workers */
+    if (RateLimits && ratelimit_init(RateLimits) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Resolve proxy upstreams and allocate their shared health state */
+    if (ProxyRoutes && proxy_init(ProxyRoutes) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Open request capture before forking so all workers append to it */
+    if (CapturePath && capture_open(CapturePath) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Map site bundle before forking so all workers share it */
+    if (BundlePath && bundle_open(BundlePath) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < nlisteners; i++) {
+        Listener *l = &listeners[i];
+        if (l->family == AF_UNIX) {
+            log("Listening on unix:%s (backlog %d)", l->address, l->backlog);
+        } else {
+            log("Listening on %s%s%s:%s (backlog %d, defer %ds, fastopen %d%s)", l->family == AF_INET6 ? "[" : "", l->address, l->family == AF_INET6 ? "]" : "", l->port,
+                l->backlog, l->defer, l->fastopen, l->reuse ? "" : ", noreuse");
+        }
+    }
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
+    debug("BundlePath      = %s", BundlePath ? BundlePath : "(none)");
     debug("DefaultMimeType = %s", DefaultMimeType);
+    debug("Backlog         = %d", Backlog);
+    debug("MaxConnections  = %zu", MaxConnections);
+    debug("MaxCGIProcesses = %zu", MaxCGIProcesses);
+    debug("CGILimits       = %d:%d:%d:%d:%d", CGICPULimit, CGIMemoryLimit, CGIFileLimit, CGIWallLimit, CGINice);
+    debug("MaxStreams      = %zu", MaxStreams);
+    debug("IOThreads       = %zu", IOThreads);
+    debug("StatsPath       = %s", StatsPath ? StatsPath : "(none)");
+    debug("CapturePath     = %s", CapturePath ? CapturePath : "(none)");
+    debug("RateLimits      = %s", RateLimits ? RateLimits : "(none)");
+    debug("ProxyRoutes     = %s", ProxyRoutes ? ProxyRoutes : "(none)");
+    debug("RouteSpecs      = %s", RouteSpecs ? RouteSpecs : "(none)");
+    debug("Timeouts        = %d:%d:%d:%d ms", IdleTimeout, HeaderTimeout, BodyTimeout, WriteTimeout);
+    debug("Upstream        = %d:%d ms", ConnectTimeout, UpstreamTimeout);
+    debug("Scanner         = %s", scanner);
     debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
 
     /* Start either forking or single HTTP server */
+    restart_ready();
     if(mode == SINGLE) {
-        return single_server(sfd);
+        return single_server(listeners, nlisteners);
     }
     else{
-        return forking_server(sfd);
+        return forking_server(listeners, nlisteners);
     }
 
     return EXIT_SUCCESS;
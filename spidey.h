@@ -2,10 +2,15 @@
 #define SPIDEY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* Constants */
@@ -23,10 +28,33 @@ typedef enum {
 
 /* Global Variables */
 
-extern char *Port;                      /**< Port number */
+extern char *Port;                      /**< Listener specifications */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern char *BundlePath;                /**< Path to site bundle (or NULL) */
+extern int   Backlog;                   /**< Listen backlog */
+extern size_t MaxConnections;           /**< Maximum concurrent connections (0 = unlimited) */
+extern size_t MaxCGIProcesses;          /**< Maximum in-flight CGI processes (0 = unlimited) */
+extern int   CGICPULimit;               /**< CPU seconds per CGI script (0 = unlimited) */
+extern int   CGIMemoryLimit;            /**< Address space MiB per CGI script (0 = unlimited) */
+extern int   CGIFileLimit;              /**< File size MiB per CGI script (0 = unlimited) */
+extern int   CGIWallLimit;              /**< Wall clock seconds per CGI script (0 = unlimited) */
+extern int   CGINice;                   /**< Niceness of CGI scripts */
+extern char *RetryAfter;                /**< Retry-After seconds for shed requests */
+extern int   IdleTimeout;               /**< Milliseconds to wait for a request to start */
+extern int   HeaderTimeout;             /**< Milliseconds to read request line and headers */
+extern int   BodyTimeout;               /**< Milliseconds to read the whole request body */
+extern int   WriteTimeout;              /**< Milliseconds a response write may stall */
+extern int   ConnectTimeout;            /**< Milliseconds to connect to an upstream */
+extern int   UpstreamTimeout;           /**< Milliseconds an upstream read or write may stall */
+extern size_t MaxStreams;               /**< Maximum concurrent HTTP/2 streams (0 = disable h2c) */
+extern char *StatsPath;                 /**< URI of statistics report (or NULL) */
+extern char *CapturePath;               /**< Path to request capture file (or NULL) */
+extern char *RateLimits;                /**< Per-client rate limit rules (or NULL) */
+extern char *ProxyRoutes;               /**< Reverse proxy routes (or NULL) */
+extern char *RouteSpecs;                /**< Route prefix options (or NULL) */
+extern size_t IOThreads;                /**< File I/O pool threads (0 = read inline) */
 
 /* Logging Macros */
 
@@ -39,8 +67,145 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Static Tracepoints (USDT, compiled out without systemtap headers) */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(name, ...)    STAP_PROBEV(spidey, name, ##__VA_ARGS__)
+#endif
+#endif
+#ifndef PROBE
+#define PROBE(name, ...)
+#endif
+
+/* Timer Wheel */
+
+#define TIMER_LEVELS    4
+#define TIMER_SLOTS     64
+
+typedef struct timer Timer;
+struct timer {
+    uint64_t    expires;                /*< Absolute expiration (milliseconds) */
+    void      (*callback)(Timer *);     /*< Function called on expiration */
+    void       *data;                   /*< User data for callback */
+    Timer      *next;                   /*< Next timer in slot */
+    Timer     **pprev;                  /*< Link pointing to this timer (NULL if idle) */
+};
+
+typedef struct {
+    uint64_t    now;                    /*< Current tick (milliseconds) */
+    size_t      count;                  /*< Number of pending timers */
+    Timer      *slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+uint64_t        timer_now(void);
+void            timer_wheel_init(TimerWheel *w, uint64_t now);
+void            timer_add(TimerWheel *w, Timer *t, uint64_t expires);
+void            timer_cancel(TimerWheel *w, Timer *t);
+void            timer_wheel_advance(TimerWheel *w, uint64_t now);
+int             timer_wheel_timeout(TimerWheel *w);
+
+/* Listeners */
+
+#define LISTENERS_MAX   16
+
+typedef struct {
+    int     fd;                         /*< Listening socket file descriptor */
+    int     family;                     /*< Address family */
+    int     backlog;                    /*< Listen backlog */
+    int     defer;                      /*< TCP_DEFER_ACCEPT seconds (0 = off) */
+    int     fastopen;                   /*< TCP_FASTOPEN queue length (0 = off) */
+    bool    reuse;                      /*< Whether SO_REUSEADDR is set */
+    char    address[NI_MAXHOST];        /*< Bound address */
+    char    port[NI_MAXSERV];           /*< Bound port */
+} Listener;
+
 /* HTTP Request */
 
+/**
+ * Request deadline phases
+ */
+typedef enum {
+    PHASE_IDLE,                         /**< Waiting for request to start */
+    PHASE_HEADER,                       /**< Reading request line and headers */
+    PHASE_BODY,                         /**< Reading request body */
+    PHASE_WRITE,                        /**< Writing response */
+} RequestPhase;
+
+/**
+ * Request trace marks (in order)
+ */
+typedef enum {
+    MARK_ACCEPT,                        /**< Connection accepted */
+    MARK_CLIENT,                        /**< Client address looked up */
+    MARK_FIRST_BYTE,                    /**< First request bytes received */
+    MARK_PARSED,                        /**< Request line and headers parsed */
+    MARK_RESOLVED,                      /**< Target resolved to a handler */
+    MARK_HANDLED,                       /**< Response written */
+    MARKS,
+} RequestMark;
+
+/**
+ * Route handlers
+ */
+typedef enum {
+    ROUTE_UNKNOWN,                      /**< Not indexed (or not servable) */
+    ROUTE_FILE,                         /**< Static file */
+    ROUTE_CGI,                          /**< CGI script */
+    ROUTE_BROWSE,                       /**< Directory listing */
+} RouteKind;
+
+typedef struct {
+    RouteKind   kind;                   /*< Forced handler (ROUTE_UNKNOWN = by file type) */
+    int         ttl;                    /*< Cache-Control max-age (-1 = none) */
+    bool        gzip;                   /*< Serve precompressed .gz variants */
+    size_t      max_body;               /*< Maximum request body (0 = unlimited) */
+} RouteOptions;
+
+typedef struct {
+    RouteKind           kind;           /*< Handler */
+    const char         *path;           /*< Real path */
+    const char         *mimetype;       /*< Mimetype (files) */
+    const char         *gzip;           /*< Real path of precompressed variant (or NULL) */
+    off_t               size;           /*< Size when compiled (files) */
+    const RouteOptions *options;        /*< Options of enclosing prefix */
+} Route;
+
+/**
+ * Well-known headers: identifier, wire name, CGI environment variable
+ */
+#define HEADER_LIST(X) \
+    X(HEADER_ACCEPT,              "Accept",               "HTTP_ACCEPT") \
+    X(HEADER_ACCEPT_ENCODING,     "Accept-Encoding",      "HTTP_ACCEPT_ENCODING") \
+    X(HEADER_ACCEPT_LANGUAGE,     "Accept-Language",      "HTTP_ACCEPT_LANGUAGE") \
+    X(HEADER_AUTHORIZATION,       "Authorization",        "HTTP_AUTHORIZATION") \
+    X(HEADER_CACHE_CONTROL,       "Cache-Control",        "HTTP_CACHE_CONTROL") \
+    X(HEADER_CONNECTION,          "Connection",           "HTTP_CONNECTION") \
+    X(HEADER_CONTENT_LENGTH,      "Content-Length",       "CONTENT_LENGTH") \
+    X(HEADER_CONTENT_TYPE,        "Content-Type",         "CONTENT_TYPE") \
+    X(HEADER_COOKIE,              "Cookie",               "HTTP_COOKIE") \
+    X(HEADER_EXPECT,              "Expect",               "HTTP_EXPECT") \
+    X(HEADER_HOST,                "Host",                 "HTTP_HOST") \
+    X(HEADER_HTTP2_SETTINGS,      "HTTP2-Settings",       "HTTP_HTTP2_SETTINGS") \
+    X(HEADER_IF_MODIFIED_SINCE,   "If-Modified-Since",    "HTTP_IF_MODIFIED_SINCE") \
+    X(HEADER_IF_NONE_MATCH,       "If-None-Match",        "HTTP_IF_NONE_MATCH") \
+    X(HEADER_IF_RANGE,            "If-Range",             "HTTP_IF_RANGE") \
+    X(HEADER_RANGE,               "Range",                "HTTP_RANGE") \
+    X(HEADER_REFERER,             "Referer",              "HTTP_REFERER") \
+    X(HEADER_TE,                  "TE",                   "HTTP_TE") \
+    X(HEADER_TRANSFER_ENCODING,   "Transfer-Encoding",    "HTTP_TRANSFER_ENCODING") \
+    X(HEADER_UPGRADE,             "Upgrade",              "HTTP_UPGRADE") \
+    X(HEADER_USER_AGENT,          "User-Agent",           "HTTP_USER_AGENT") \
+    X(HEADER_X_FORWARDED_FOR,     "X-Forwarded-For",      "HTTP_X_FORWARDED_FOR")
+
+#define HEADER_ENUM(id, name, env)  id,
+
+typedef enum {
+    HEADER_LIST(HEADER_ENUM)
+    HEADER_KNOWN,                       /**< Number of known headers (unknown) */
+} HeaderId;
+
 typedef struct header Header;
 struct header {
     char    *name;                      /*< Name of header entry */
@@ -48,23 +213,72 @@ struct header {
     Header  *next;                      /*< Next header entry */
 };
 
+/**
+ * Client address (kept numeric; formatted only for logs and CGI)
+ */
 typedef struct {
-    int     fd;                         /*< Client socket file descripter */
-    FILE    *file;                      /*< Client socket file stream */
-    char    *method;                    /*< HTTP method */
-    char    *uri;                       /*< HTTP uniform resource identifier */
-    char    *path;                      /*< Real path corrsponding to URI and RootPath */
-    char    *query;                     /*< HTTP query string */
+    sa_family_t family;                 /*< AF_INET, AF_INET6 or AF_UNIX */
+    uint32_t    port;                   /*< Port (or peer process id for AF_UNIX) */
+    uint8_t     addr[16];               /*< Address in network order (IPv4 in first 4 bytes) */
+} ClientAddress;
+
+#define REQUEST_ALIGN       64          /* Requests start on a cache line */
+#define REQUEST_BUFFER_MIN  1024        /* Initial read buffer */
+#define REQUEST_BUFFER_MAX  BUFSIZ      /* Largest read buffer (and so longest line) */
+#define REQUEST_HOST_MAX    INET6_ADDRSTRLEN    /* Formatted client address */
+
+typedef struct request Request;
+struct request {
+    /* Hot: touched by every read of the client socket */
+    int          fd;                    /*< Client socket file descripter */
+    RequestPhase phase;                 /*< Current deadline phase */
+    bool         expired;               /*< Whether deadline of current phase passed */
+    char        *buffer;                /*< Read buffer (allocated on first read) */
+    uint32_t     start;                 /*< Start of unparsed bytes in buffer */
+    uint32_t     end;                   /*< End of bytes read into buffer */
+    uint32_t     capacity;              /*< Size of buffer */
+    int          version;               /*< HTTP version (10 = HTTP/1.0, 11 = HTTP/1.1, 20 = HTTP/2) */
+    Timer        timer;                 /*< Deadline of current phase (on the process wheel) */
 
-    char host[NI_MAXHOST];              /*< Host name of client */
-    char port[NI_MAXSERV];              /*< Port number of client */
+    /* Parsed request and its resolution */
+    char        *method;                /*< HTTP method */
+    char        *uri;                   /*< HTTP uniform resource identifier */
+    char        *query;                 /*< HTTP query string */
+    char        *path;                  /*< Real path corrsponding to URI and RootPath */
+    const Listener     *listener;       /*< Listener that accepted client */
+    const Route        *route;          /*< Compiled route (or NULL if not indexed) */
+    const RouteOptions *options;        /*< Options of matching route prefix */
+    char        *known[HEADER_KNOWN];   /*< Values of well-known headers */
+    Header      *headers;               /*< List of other name, value Header pairs */
 
-    Header  *headers;                   /*< List of name, value Header pairs */
-} Request;
+    /* Cold: logging, statistics and recycling */
+    ClientAddress peer;                 /*< Client address */
+    uint64_t     marks[MARKS];          /*< Trace timestamps (trace_now, 0 = not reached) */
+    uint64_t     written;               /*< response_write_time when accepted */
+    uint64_t     cpu;                   /*< CPU microseconds used by CGI script */
+    uint32_t     rss;                   /*< Peak RSS of CGI script in KiB (0 = no script) */
+    uint32_t     upstream;              /*< Status code relayed from proxy upstream (0 = none) */
+    Request     *next;                  /*< Next request on free list */
+} __attribute__((aligned(REQUEST_ALIGN)));
 
-Request *       accept_request(int sfd);
+#define request_buffered(r) ((size_t)((r)->end - (r)->start))
+
+Request *       request_alloc(void);
+Request *       accept_request(const Listener *listener);
 void	        free_request(Request *request);
 int	        parse_request(Request *request);
+char *          request_line(Request *request, size_t *length, bool wait);
+size_t          request_read(Request *request, void *buffer, size_t length);
+const char *    request_host(const Request *request, char *host, size_t size);
+int             request_add_header(Request *request, const char *name, size_t nlength, const char *value, size_t vlength);
+const char *    request_header(Request *request, HeaderId id);
+
+int             header_init(void);
+HeaderId        header_lookup(const char *name, size_t length);
+const char *    header_name(HeaderId id);
+const char *    header_env(HeaderId id);
+void            request_set_phase(Request *request, RequestPhase phase);
+int             request_poll(Request *request, struct pollfd *pfds, nfds_t nfds, int timeout);
 
 /* HTTP Request Handlers */
 
@@ -73,18 +287,224 @@ typedef enum {
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+    HTTP_STATUS_REQUEST_TIMEOUT,	/* 408 Request Timeout */
+    HTTP_STATUS_TOO_MANY_REQUESTS,	/* 429 Too Many Requests */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
+    HTTP_STATUS_GATEWAY_TIMEOUT,	/* 504 Gateway Timeout */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
 } HTTPStatus;
 
 HTTPStatus      handle_request(Request *request);
+HTTPStatus      handle_error(Request *request, HTTPStatus status);
+HTTPStatus      dispatch_request(Request *request);
+
+/* Request Bodies */
+
+typedef struct {
+    Request    *r;                      /*< Request whose body is read */
+    bool        chunked;                /*< Chunked transfer encoding */
+    bool        crlf;                   /*< Line ending after chunk data pending */
+    bool        trailers;               /*< Last chunk read; trailers pending */
+    bool        done;                   /*< Whole body read */
+    ssize_t     length;                 /*< Declared length (-1 if chunked) */
+    size_t      remaining;              /*< Bytes left in body (or current chunk) */
+    size_t      total;                  /*< Bytes of body read so far */
+    size_t      limit;                  /*< Maximum body size (0 = unlimited) */
+    int         wait_fd;                /*< Fd to wait on after EAGAIN */
+    short       wait_events;            /*< Poll events to wait for */
+    size_t      start;                  /*< Start of unwritten buffered bytes */
+    size_t      end;                    /*< End of unwritten buffered bytes */
+    char        buffer[BUFSIZ];         /*< Bytes taken from the request stream */
+} Body;
+
+HTTPStatus      body_init(Body *b, Request *r);
+ssize_t         body_transfer(Body *b, int fd);
+
+/* HTTP Response Writer */
+
+#define RESPONSE_IOV_MAX    64
+#define RESPONSE_SCRATCH    2048
+
+typedef struct {
+    int           fd;                   /*< Client socket file descriptor */
+    int           iovcnt;               /*< Number of pending slices */
+    size_t        pending;              /*< Number of pending bytes */
+    size_t        used;                 /*< Number of scratch bytes in use */
+    size_t        sent;                 /*< Number of bytes written so far */
+    bool          corked;               /*< Whether TCP_CORK is set */
+    bool          chunked;              /*< Body framed with chunked encoding (HTTP/1.1) */
+    Request      *request;              /*< Request whose deadline bounds stalls (or NULL) */
+    struct iovec  iov[RESPONSE_IOV_MAX];/*< Pending header and body slices */
+    char          scratch[RESPONSE_SCRATCH]; /*< Storage for formatted slices */
+} Response;
+
+void            response_init(Response *w, int fd, Request *request);
+int             response_status(Response *w, HTTPStatus status);
+int             response_status_code(Response *w, int code, const char *reason);
+int             response_reject(int fd, HTTPStatus status, const char *retry);
+int             response_header(Response *w, const char *name, const char *value);
+int             response_content_length(Response *w, size_t length);
+int             response_end_headers(Response *w);
+int             response_append(Response *w, const void *data, size_t length);
+int             response_chunk(Response *w, const void *data, size_t length);
+int             response_end_chunks(Response *w);
+int             response_copy(Response *w, const void *data, size_t length);
+int             response_printf(Response *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int             response_flush(Response *w, bool more);
+void            response_configure_socket(int fd);
+uint64_t        response_write_time(void);
+
+/* Admission Control */
+
+int             admission_init(void);
+bool            admission_cgi_acquire(void);
+void            admission_cgi_release(void);
+void            admission_active(size_t active);
+void            admission_reject(int fd);
+int             admission_report(Response *w);
+
+/* Rate Limiting */
+
+int             ratelimit_init(const char *specs);
+uint64_t        ratelimit_check(const Request *request, const char *uri);
+void            ratelimit_reject(Request *request, uint64_t wait);
+
+/* Reverse Proxy */
+
+typedef struct proxy_route ProxyRoute;
+
+int                 proxy_init(const char *specs);
+const ProxyRoute *  proxy_lookup(const char *uri);
+HTTPStatus          proxy_forward(Request *request, const ProxyRoute *route);
+
+/* File I/O Pool */
+
+#define IOPOOL_THRESHOLD    (256*1024)  /* Files at least this large are read by the pool */
+#define IOPOOL_BLOCK        (64*1024)   /* Size of each pooled read */
+
+typedef enum {
+    IO_READ,                            /* pread into buffer */
+    IO_ADVISE,                          /* Readahead of whole file at path */
+} IOOp;
+
+typedef struct io_task IOTask;
+struct io_task {
+    IOOp        op;                     /*< Operation */
+    const char *path;                   /*< Path of file (IO_ADVISE) */
+    int         fd;                     /*< File descriptor (IO_READ) */
+    void       *buffer;                 /*< Destination buffer (IO_READ) */
+    size_t      length;                 /*< Bytes to read (IO_READ) */
+    off_t       offset;                 /*< File offset (IO_READ) */
+    ssize_t     result;                 /*< Result of operation */
+    int         error;                  /*< errno of operation */
+    int         notify;                 /*< eventfd posted on completion (-1 = detached) */
+    IOTask     *next;                   /*< Next queued task */
+};
+
+void            iopool_submit(IOTask *t);
+ssize_t         iopool_wait(IOTask *t);
+void            iopool_advise(const char *path);
+
+/* Site Bundle */
+
+typedef struct {
+    const char  *data;                  /*< Contents */
+    size_t       length;                /*< Length of contents */
+    const char  *mimetype;              /*< Mimetype */
+    const char  *etag;                  /*< Quoted ETag */
+    const char  *gzip;                  /*< Precompressed contents (or NULL) */
+    size_t       gzip_length;           /*< Length of precompressed contents */
+} BundleEntry;
+
+int             bundle_build(const char *root, const char *path);
+int             bundle_open(const char *path);
+bool            bundle_lookup(const char *uri, BundleEntry *entry);
+
+/* HPACK */
+
+typedef void (*HPACKEmit)(void *ctx, const char *name, const char *value);
+
+typedef struct {
+    char       *name;                   /*< Header name */
+    char       *value;                  /*< Header value */
+} HPACKEntry;
+
+typedef struct {
+    HPACKEntry *entries;                /*< Dynamic table ring (newest at head) */
+    size_t      capacity;               /*< Number of ring slots */
+    size_t      head;                   /*< Index of newest entry */
+    size_t      count;                  /*< Number of entries */
+    size_t      size;                   /*< Table size as defined by RFC 7541 */
+    size_t      max_size;               /*< Current maximum table size */
+    size_t      limit;                  /*< Protocol maximum table size */
+} HPACKTable;
+
+int             hpack_init(HPACKTable *t, size_t max_size);
+void            hpack_free(HPACKTable *t);
+int             hpack_decode(HPACKTable *t, const uint8_t *data, size_t length, HPACKEmit emit, void *ctx);
+size_t          hpack_encode_status(uint8_t *out, int status);
+size_t          hpack_encode_header(uint8_t *out, const char *name, const char *value);
+
+/* HTTP/2 */
+
+HTTPStatus      h2_serve(Request *r, bool upgraded);
+bool            h2_upgrade_requested(Request *r);
 
 /* HTTP Server */
 
-int             single_server(int sfd);
-int             forking_server(int sfd);
+int             single_server(Listener *listeners, size_t nlisteners);
+int             forking_server(Listener *listeners, size_t nlisteners);
 
 /* Socket */
 
-int	        socket_listen(const char *port);
+size_t          socket_listen(const char *specs, int backlog, Listener *listeners, size_t max);
+int             socket_adopt(int fd, int backlog, Listener *listener);
+
+/* Restart */
+
+void            restart_init(char *argv[]);
+int             restart_reload(void);
+pid_t           restart_upgrade(Listener *listeners, size_t nlisteners);
+void            restart_ready(void);
+size_t          restart_inherit(Listener *listeners, size_t max);
+
+/* Request Scanning */
+
+typedef enum {
+    SCAN_TOKEN,                         /**< Method and header name characters */
+    SCAN_URI,                           /**< Request target up to the query */
+    SCAN_QUERY,                         /**< Query string characters */
+    SCAN_VALUE,                         /**< Header value characters */
+    SCAN_CLASSES,
+} ScanClass;
+
+const char *    scan_init(void);
+size_t          scan_span(const char *s, size_t n, ScanClass class);
+
+/* Route Table */
+
+int             route_init(const char *specs);
+int             route_compile(void);
+const Route *   route_lookup(const char *uri, const RouteOptions **options);
+RouteKind       route_classify(const char *path, mode_t mode, const RouteOptions *options);
+
+/* Request Tracing and Statistics */
+
+#define request_mark(r, m)  ((r)->marks[(m)] = trace_now())
+
+uint64_t        trace_now(void);
+int             stats_init(void);
+void            stats_record(Request *request, HTTPStatus status);
+int             stats_write(Response *w);
+void            stats_cgi(Request *request, const struct rusage *usage, bool killed);
+int             request_report(Response *w);
+
+/* Request Capture */
+
+int             capture_open(const char *path);
+void            capture_record(Request *request);
 
 /* Utilities */
 
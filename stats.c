@@ -0,0 +1,297 @@
+/* stats.c: Request Phase Tracing and Statistics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/* Reported phases (durations between consecutive marks) */
+
+typedef enum {
+    STAT_LOOKUP,                        /*< Accept to client lookup */
+    STAT_IDLE,                          /*< Client lookup to first bytes */
+    STAT_PARSE,                         /*< First bytes to parsed headers */
+    STAT_RESOLVE,                       /*< Parsed to resolved path */
+    STAT_HANDLE,                        /*< Resolved to handler return */
+    STAT_WRITE,                         /*< Time spent writing (within handle) */
+    STAT_TOTAL,                         /*< Accept to handler return */
+    STAT_PHASES,
+} StatPhase;
+
+static const char *StatNames[STAT_PHASES] = {
+    "lookup", "idle", "parse", "resolve", "handle", "write", "total",
+};
+
+#define STATS_BUCKETS   32              /* log2 microsecond histogram buckets */
+
+typedef struct {
+    uint64_t count;                     /*< Number of samples */
+    uint64_t sum;                       /*< Sum of samples (ns) */
+    uint64_t max;                       /*< Largest sample (ns) */
+    uint64_t buckets[STATS_BUCKETS];    /*< Samples by log2(us) */
+} StatHistogram;
+
+#define STATS_SCRIPTS   64              /* CGI scripts accounted individually */
+#define STATS_NAME      64              /* Bytes of script name kept */
+
+typedef struct {
+    uint64_t key;                       /*< Hash of script path (0 = empty) */
+    char     name[STATS_NAME];          /*< Script path below RootPath */
+    uint64_t runs;                      /*< Number of runs */
+    uint64_t killed;                    /*< Runs ended by a signal (limits, timeouts) */
+    uint64_t user;                      /*< User CPU time (us) */
+    uint64_t system;                    /*< System CPU time (us) */
+    uint64_t rss;                       /*< Largest peak RSS (KiB) */
+} StatScript;
+
+typedef struct {
+    uint64_t      requests;             /*< Number of requests recorded */
+    uint64_t      classes[6];           /*< Responses by status class (Nxx) */
+    StatHistogram phases[STAT_PHASES];  /*< Phase durations */
+    StatScript    scripts[STATS_SCRIPTS];   /*< CGI resource usage by script */
+} Stats;
+
+static Stats *Shared = NULL;
+
+/**
+ * Return current monotonic time in nanoseconds.
+ **/
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Allocate statistics shared by all worker processes.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked.
+ **/
+int stats_init(void) {
+    void *map = mmap(NULL, sizeof(Stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Unable to mmap statistics: %s\n", strerror(errno));
+        return -1;
+    }
+
+    Shared = map;
+    return 0;
+}
+
+/**
+ * Add sample to histogram.
+ **/
+static void stats_sample(StatHistogram *h, uint64_t ns) {
+    uint64_t us     = ns / 1000;
+    int      bucket = us ? 64 - __builtin_clzll(us) : 0;
+    uint64_t max    = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Return time of mark, falling back to the latest earlier mark reached.
+ **/
+static uint64_t stats_mark(Request *r, RequestMark mark) {
+    while (mark > MARK_ACCEPT && r->marks[mark] == 0) {
+        mark--;
+    }
+    return r->marks[mark];
+}
+
+/**
+ * Record completed request in the access log and statistics.
+ *
+ * @param   r           Request structure.
+ * @param   status      Status of request.
+ *
+ * Phases a request never reached (e.g. path resolution for a parse error)
+ * count as zero.  A proxied request is recorded with the status code the
+ * upstream answered rather than the status of relaying it.
+ **/
+void stats_record(Request *r, HTTPStatus status) {
+    uint64_t durations[STAT_PHASES];
+    const char *line = http_status_string(status);
+    char        relayed[12];
+
+    if (r->upstream) {
+        snprintf(relayed, sizeof(relayed), "%03u", r->upstream);
+        line = relayed;
+    }
+
+    if (!r->marks[MARK_HANDLED]) {
+        request_mark(r, MARK_HANDLED);
+    }
+
+    for (RequestMark m = MARK_CLIENT; m <= MARK_HANDLED; m++) {
+        durations[m - 1] = stats_mark(r, m) - stats_mark(r, m - 1);
+    }
+    durations[STAT_WRITE] = response_write_time() - r->written;
+    durations[STAT_TOTAL] = r->marks[MARK_HANDLED] - r->marks[MARK_ACCEPT];
+
+    char host[REQUEST_HOST_MAX];
+    char cgi[64] = "";
+    if (r->rss) {
+        snprintf(cgi, sizeof(cgi), " cpu=%.3f rss=%uK", r->cpu / 1e3, r->rss);
+    }
+
+    log("%s:%u \"%s %s\" %.3s total=%.3fms lookup=%.3f idle=%.3f parse=%.3f resolve=%.3f handle=%.3f write=%.3f%s",
+        request_host(r, host, sizeof(host)), r->peer.port, r->method ? r->method : "-", r->uri ? r->uri : "-", line,
+        durations[STAT_TOTAL] / 1e6, durations[STAT_LOOKUP] / 1e6, durations[STAT_IDLE] / 1e6,
+        durations[STAT_PARSE] / 1e6, durations[STAT_RESOLVE] / 1e6, durations[STAT_HANDLE] / 1e6,
+        durations[STAT_WRITE] / 1e6, cgi);
+    PROBE(request__done, r->uri, atoi(line), durations[STAT_TOTAL]);
+
+    if (!Shared) {
+        return;
+    }
+
+    int class = line[0] - '0';
+    __atomic_add_fetch(&Shared->requests, 1, __ATOMIC_RELAXED);
+    if (class >= 0 && class < 6) {
+        __atomic_add_fetch(&Shared->classes[class], 1, __ATOMIC_RELAXED);
+    }
+    for (StatPhase p = 0; p < STAT_PHASES; p++) {
+        stats_sample(&Shared->phases[p], durations[p]);
+    }
+}
+
+/**
+ * Find or claim accounting slot for script (like the rate limit buckets, an
+ * open addressed table keyed by a hash claimed with compare-and-swap).
+ **/
+static StatScript * stats_script(const char *path) {
+    uint64_t key = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *c = (const unsigned char *)path; *c; c++) {
+        key = (key ^ *c) * 0x100000001b3ULL;
+    }
+    key = key ? key : 1;
+
+    for (size_t probe = 0; probe < STATS_SCRIPTS; probe++) {
+        StatScript *s = &Shared->scripts[(key + probe) % STATS_SCRIPTS];
+        uint64_t    k = 0;
+
+        if (__atomic_compare_exchange_n(&s->key, &k, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            /* Keep the end of the name, which tells scripts apart */
+            size_t root   = strncmp(path, RootPath, strlen(RootPath)) == 0 ? strlen(RootPath) : 0;
+            size_t length = strlen(path + root);
+            const char *name = path + root + (length >= STATS_NAME ? length - STATS_NAME + 1 : 0);
+            strncpy(s->name, name, STATS_NAME - 1);
+            return s;
+        }
+        if (k == key) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Record resource usage of a finished CGI script.
+ *
+ * @param   r           Request structure (script in r->path).
+ * @param   usage       Resource usage from wait4 (includes the script's
+ *                      own children).
+ * @param   killed      Whether the script was ended by a signal.
+ *
+ * The usage is kept on the request for the access log and accumulated per
+ * script for the statistics report.
+ **/
+void stats_cgi(Request *r, const struct rusage *usage, bool killed) {
+    uint64_t user   = usage->ru_utime.tv_sec * 1000000ULL + usage->ru_utime.tv_usec;
+    uint64_t system = usage->ru_stime.tv_sec * 1000000ULL + usage->ru_stime.tv_usec;
+    uint64_t rss    = usage->ru_maxrss > 0 ? usage->ru_maxrss : 1;
+
+    r->cpu = user + system;
+    r->rss = rss;
+
+    StatScript *s = Shared && r->path ? stats_script(r->path) : NULL;
+    if (!s) {
+        return;
+    }
+
+    uint64_t max = __atomic_load_n(&s->rss, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->runs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->killed, killed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->user, user, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->system, system, __ATOMIC_RELAXED);
+    while (rss > max && !__atomic_compare_exchange_n(&s->rss, &max, rss, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Estimate percentile from histogram (upper bound of bucket, microseconds).
+ **/
+static uint64_t stats_percentile(const StatHistogram *h, double percentile) {
+    uint64_t target = h->count * percentile;
+    uint64_t seen   = 0;
+
+    uint64_t max    = h->max / 1000;
+
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > target) {
+            uint64_t bound = b ? 1ULL << b : 1;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+/**
+ * Write statistics report.
+ *
+ * @param   w           Response writer.
+ * @return  -1 on error and 0 on success.
+ **/
+int stats_write(Response *w) {
+    Stats s;
+
+    if (!Shared) {
+        return response_printf(w, "statistics disabled\n");
+    }
+    memcpy(&s, Shared, sizeof(s));
+
+    response_printf(w, "requests %" PRIu64 "\n", s.requests);
+    for (int c = 1; c < 6; c++) {
+        response_printf(w, "responses_%dxx %" PRIu64 "\n", c, s.classes[c]);
+    }
+
+    response_printf(w, "%-8s %10s %10s %10s %10s %10s\n", "phase", "count", "mean_us", "p50_us", "p99_us", "max_us");
+    for (StatPhase p = 0; p < STAT_PHASES; p++) {
+        const StatHistogram *h = &s.phases[p];
+        response_printf(w, "%-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", StatNames[p], h->count,
+                        h->count ? h->sum / h->count / 1000 : 0, stats_percentile(h, 0.50),
+                        stats_percentile(h, 0.99), h->max / 1000);
+    }
+
+    bool header = false;
+    for (size_t i = 0; i < STATS_SCRIPTS; i++) {
+        const StatScript *script = &s.scripts[i];
+        if (!script->runs) {
+            continue;
+        }
+        if (!header) {
+            response_printf(w, "%-32s %8s %8s %10s %10s %10s %10s\n", "script", "runs", "killed", "user_ms", "sys_ms", "mean_ms", "max_rss_k");
+            header = true;
+        }
+        response_printf(w, "%-32s %8" PRIu64 " %8" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", script->name, script->runs, script->killed,
+                        script->user / 1000, script->system / 1000, (script->user + script->system) / script->runs / 1000, script->rss);
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
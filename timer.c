@@ -0,0 +1,185 @@
+/* timer.c: Hierarchical Timer Wheel */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Each level has TIMER_SLOTS slots and every slot at level L spans
+ * TIMER_SLOTS^L milliseconds, so four levels of 64 slots cover ~4.6 hours.
+ * Timers further out are clamped to the last level. */
+
+#define TIMER_BITS      6
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+#define TIMER_SPAN(l)   (1ULL << (TIMER_BITS * (l)))
+
+/**
+ * Return current monotonic time in milliseconds.
+ **/
+uint64_t timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Link timer into the slot appropriate for its expiration.
+ **/
+static void timer_insert(TimerWheel *w, Timer *t) {
+    uint64_t delta = t->expires > w->now ? t->expires - w->now : 0;
+    uint64_t expires = t->expires;
+    int      level;
+
+    if (delta >= TIMER_SPAN(TIMER_LEVELS)) {
+        expires = w->now + TIMER_SPAN(TIMER_LEVELS) - 1;
+        delta   = expires - w->now;
+    }
+    if (expires < w->now) {
+        expires = w->now;
+    }
+
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        if (delta < TIMER_SPAN(level + 1)) {
+            break;
+        }
+    }
+
+    Timer **slot = &w->slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    t->next  = *slot;
+    t->pprev = slot;
+    if (*slot) {
+        (*slot)->pprev = &t->next;
+    }
+    *slot = t;
+}
+
+/**
+ * Unlink timer from its slot.
+ **/
+static void timer_unlink(Timer *t) {
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->next  = NULL;
+    t->pprev = NULL;
+}
+
+/**
+ * Initialize empty timer wheel.
+ *
+ * @param   w           Timer wheel.
+ * @param   now         Current time (from timer_now).
+ **/
+void timer_wheel_init(TimerWheel *w, uint64_t now) {
+    memset(w, 0, sizeof(TimerWheel));
+    w->now = now;
+}
+
+/**
+ * Schedule timer.
+ *
+ * @param   w           Timer wheel.
+ * @param   t           Timer (callback and data must be set).
+ * @param   expires     Absolute expiration time in milliseconds.
+ *
+ * Timers that have already expired fire on the next tick.
+ **/
+void timer_add(TimerWheel *w, Timer *t, uint64_t expires) {
+    if (t->pprev) {
+        timer_cancel(w, t);
+    }
+
+    t->expires = expires > w->now ? expires : w->now + 1;
+    timer_insert(w, t);
+    w->count++;
+}
+
+/**
+ * Cancel pending timer in O(1).
+ *
+ * @param   w           Timer wheel.
+ * @param   t           Timer (ignored if not pending).
+ **/
+void timer_cancel(TimerWheel *w, Timer *t) {
+    if (!t->pprev) {
+        return;
+    }
+
+    timer_unlink(t);
+    w->count--;
+}
+
+/**
+ * Move timers in a higher level slot down to the levels below.
+ **/
+static void timer_cascade(TimerWheel *w, int level, size_t index) {
+    Timer *t = w->slots[level][index];
+    w->slots[level][index] = NULL;
+
+    while (t) {
+        Timer *next = t->next;
+        t->next  = NULL;
+        t->pprev = NULL;
+        timer_insert(w, t);
+        t = next;
+    }
+}
+
+/**
+ * Advance wheel to the current time and fire expired timers.
+ *
+ * @param   w           Timer wheel.
+ * @param   now         Current time (from timer_now).
+ *
+ * Callbacks may add or cancel timers (including the one firing).
+ **/
+void timer_wheel_advance(TimerWheel *w, uint64_t now) {
+    while (w->now < now) {
+        if (w->count == 0) {
+            w->now = now;
+            break;
+        }
+
+        uint64_t tick = ++w->now;
+
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if (tick & (TIMER_SPAN(level) - 1)) {
+                break;
+            }
+            timer_cascade(w, level, (tick >> (TIMER_BITS * level)) & TIMER_MASK);
+        }
+
+        Timer **slot = &w->slots[0][tick & TIMER_MASK];
+        while (*slot) {
+            Timer *t = *slot;
+            timer_unlink(t);
+            w->count--;
+            t->callback(t);
+        }
+    }
+}
+
+/**
+ * Compute poll timeout until the wheel next needs to be advanced.
+ *
+ * @param   w           Timer wheel.
+ * @return  Timeout in milliseconds or -1 if there are no timers.
+ **/
+int timer_wheel_timeout(TimerWheel *w) {
+    if (w->count == 0) {
+        return -1;
+    }
+
+    /* Stop at the next cascade boundary: timers above level 0 may land in
+     * any level 0 slot after it */
+    int boundary = TIMER_SLOTS - (w->now & TIMER_MASK);
+    for (int i = 1; i < boundary; i++) {
+        if (w->slots[0][(w->now + i) & TIMER_MASK]) {
+            return i;
+        }
+    }
+    return boundary;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
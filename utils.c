@@ -41,32 +41,36 @@ char * determine_mimetype(const char *path) {
     if(!path) return strdup(DefaultMimeType);
 
     /* Find file extension */
-    if (strrchr(path, '.') == NULL) {
-        return DefaultMimeType;
-    } else {
-        ext = strrchr(path, '.') + 1;
+    if ((ext = strrchr(path, '.')) == NULL) {
+        return strdup(DefaultMimeType);
     }
+    ext++;
 
     /* Open MimeTypesPath file */
-    fs = fopen(path, "w+");
+    fs = fopen(MimeTypesPath, "r");
     if (!fs) {
         fprintf(stderr, "Unable to fopen: %s\n", strerror(errno));
-        fclose(fs);
+        return strdup(DefaultMimeType);
     }
 
     /* Scan file for matching file extensions */
     while (fgets(buffer, BUFSIZ, fs)) {
-        mimetype = strtok(buffer, " ");
-	token = mimetype;
-        token = skip_whitespace(token);
-        if (streq(token, ext)) {
-	    *token = '\0';
-	    debug("Mimetype: %s", mimetype);
-            return mimetype;
+        if (buffer[0] == '#') {
+            continue;
+        }
+        if ((mimetype = strtok(buffer, WHITESPACE)) == NULL) {
+            continue;
+        }
+        while ((token = strtok(NULL, WHITESPACE)) != NULL) {
+            if (streq(token, ext)) {
+                fclose(fs);
+                return strdup(mimetype);
+            }
         }
     }
 
-    return DefaultMimeType;
+    fclose(fs);
+    return strdup(DefaultMimeType);
 }
 
 /**
@@ -118,10 +122,16 @@ const char * http_status_string(HTTPStatus status) {
         "400 Bad Request",
         "404 Not Found",
         "500 Internal Server Error",
-        "418 I'm A Teapot",
+        "304 Not Modified",
+        "503 Service Unavailable",
+        "408 Request Timeout",
+        "429 Too Many Requests",
+        "502 Bad Gateway",
+        "504 Gateway Timeout",
+        "413 Payload Too Large",
     };
 
-    if (status >= 0 && status < 4) {
+    if (status >= 0 && status < sizeof(StatusStrings) / sizeof(StatusStrings[0])) {
         return StatusStrings[status];
     } else {
         return NULL;